@@ -0,0 +1,60 @@
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+/**
+ * Función: arena_init
+ * -------------------
+ * Reserva el bloque de la arena con mmap para que no fragmente el heap y
+ * se devuelva completo al sistema al destruirla.
+ *
+ * size: tamaño total de la arena en bytes
+ *
+ * return: true si se pudo reservar
+ */
+bool arena_init(struct arena *arena, size_t size) {
+    arena->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena->base == MAP_FAILED) {
+        arena->base = NULL;
+        return false;
+    }
+    arena->size = size;
+    arena->used = 0;
+    return true;
+}
+
+void arena_destroy(struct arena *arena) {
+    if (arena->base) munmap(arena->base, arena->size);
+    arena->base = NULL;
+    arena->size = arena->used = 0;
+}
+
+/**
+ * Función: arena_alloc
+ * --------------------
+ * Toma size bytes alineados de la arena.
+ *
+ * return: puntero a la memoria, NULL si la arena está agotada
+ */
+void *arena_alloc(struct arena *arena, size_t size) {
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (start > arena->size || size > arena->size - start) return NULL;
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+size_t arena_mark(const struct arena *arena) {
+    return arena->used;
+}
+
+/**
+ * Función: arena_release
+ * ----------------------
+ * Devuelve todo lo reservado después de la marca.
+ */
+void arena_release(struct arena *arena, size_t mark) {
+    if (mark <= arena->used) arena->used = mark;
+}
@@ -0,0 +1,24 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Arena: un único bloque reservado de una vez (la memoria fija de una
+ * sesión, o los buffers de escritura diferida de un STOR) del que se toman
+ * todas las reservas. Las reservas temporales se devuelven en bloque
+ * volviendo a una marca; nada se libera individualmente.
+ */
+struct arena {
+    char *base;
+    size_t size, used;
+};
+
+bool arena_init(struct arena *arena, size_t size);
+void arena_destroy(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+size_t arena_mark(const struct arena *arena);
+void arena_release(struct arena *arena, size_t mark);
+
+#endif
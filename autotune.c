@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "autotune.h"
+
+#define TUNE_FIRST_CHUNK (64 * 1024)
+#define TUNE_MIN_INTERVAL 20    // ms entre mediciones con RTT muy bajo
+#define TUNE_CHUNK_TIME 10      // ms de transferencia que debe cubrir cada bloque
+#define TUNE_MIN_BUFFER (64 * 1024)
+
+struct tune_limits tune_limits = { 16 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static size_t clamp_chunk(size_t chunk) {
+    if (chunk < tune_limits.min_chunk) return tune_limits.min_chunk;
+    if (chunk > tune_limits.max_chunk) return tune_limits.max_chunk;
+    return chunk;
+}
+
+/**
+ * Función: tune_limits_parse
+ * --------------------------
+ * Lee los límites en KiB con la forma "min:max[:buffer]". Los bloques
+ * admiten fracciones: "0.5:0.5:0" fija el bloque de 512 bytes anterior al
+ * ajuste, con los buffers del kernel.
+ *
+ * return: false si la especificación es inválida
+ */
+bool tune_limits_parse(const char *spec) {
+    double min, max;
+    long buffer = tune_limits.max_buffer / 1024;
+    int n;
+
+    n = sscanf(spec, "%lf:%lf:%ld", &min, &max, &buffer);
+    if (n < 2 || min * 1024 < 1 || max < min || buffer < 0) return false;
+    tune_limits.min_chunk = min * 1024;
+    tune_limits.max_chunk = max * 1024;
+    tune_limits.max_buffer = buffer * 1024;
+    return true;
+}
+
+/**
+ * Función: autotune_start
+ * -----------------------
+ * Empieza a medir una transferencia. El buffer del socket queda a cargo
+ * del kernel hasta que la primera medición pida uno mayor.
+ *
+ * sd: canal de datos
+ * sending: true si este extremo envía (se ajusta SO_SNDBUF), false si
+ * recibe (SO_RCVBUF)
+ */
+void autotune_start(struct autotune *tune, int sd, bool sending) {
+    memset(tune, 0, sizeof(*tune));
+    tune->sd = sd;
+    tune->sending = sending;
+    tune->chunk = clamp_chunk(TUNE_FIRST_CHUNK);
+    clock_gettime(CLOCK_MONOTONIC, &tune->start);
+    tune->window_start = tune->start;
+}
+
+/**
+ * Función: set_buffer
+ * -------------------
+ * Ajusta el buffer del socket al doble del producto caudal × RTT, para
+ * que la ventana no limite el caudal. Mientras el kernel lo maneja sólo se
+ * toca para agrandarlo (fijarlo desactiva su ajuste automático); después
+ * se cambia sólo si difiere más de un 25% de lo pedido.
+ */
+static void set_buffer(struct autotune *tune) {
+    int option = tune->sending ? SO_SNDBUF : SO_RCVBUF, current = 0, target;
+    socklen_t len = sizeof(current);
+    double bdp = tune->rate * tune->rtt_us / 1e6;
+
+    if (tune_limits.max_buffer == 0 || tune->rtt_us == 0) return;
+    target = 2 * bdp < TUNE_MIN_BUFFER ? TUNE_MIN_BUFFER : 2 * bdp;
+    if (target > tune_limits.max_buffer) target = tune_limits.max_buffer;
+
+    if (tune->buffer == 0) {
+        // El kernel informa el doble de lo pedido
+        if (getsockopt(tune->sd, SOL_SOCKET, option, &current, &len) < 0 || target <= current / 2) return;
+    } else if (target > tune->buffer * 3 / 4 && target < tune->buffer * 5 / 4) {
+        return;
+    }
+    if (setsockopt(tune->sd, SOL_SOCKET, option, &target, sizeof(target)) == 0) tune->buffer = target;
+}
+
+/**
+ * Función: autotune_update
+ * ------------------------
+ * Registra bytes transferidos. Una vez por RTT (o TUNE_MIN_INTERVAL) mide
+ * el caudal y elige el próximo tamaño de bloque: lo que se transfiere en
+ * TUNE_CHUNK_TIME, como mucho el doble o la mitad del anterior y nunca
+ * más de medio buffer del socket.
+ */
+void autotune_update(struct autotune *tune, size_t bytes) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    struct timespec now;
+    double seconds;
+    size_t chunk;
+
+    tune->bytes += bytes;
+    tune->window_bytes += bytes;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seconds = elapsed(&tune->window_start, &now);
+    if (seconds * 1000 < TUNE_MIN_INTERVAL || seconds * 1e6 < tune->rtt_us) return;
+
+    if (getsockopt(tune->sd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) tune->rtt_us = info.tcpi_rtt;
+    tune->rate = tune->window_bytes / seconds;
+    tune->window_bytes = 0;
+    tune->window_start = now;
+
+    chunk = tune->rate * TUNE_CHUNK_TIME / 1000;
+    if (chunk > 2 * tune->chunk) chunk = 2 * tune->chunk;
+    if (chunk < tune->chunk / 2) chunk = tune->chunk / 2;
+    if (tune->buffer > 0 && chunk > (size_t) tune->buffer / 2) chunk = tune->buffer / 2;
+    tune->chunk = clamp_chunk(chunk);
+
+    set_buffer(tune);
+}
+
+/**
+ * Función: autotune_report
+ * ------------------------
+ * Describe la transferencia y los valores elegidos en una línea de
+ * métricas "clave=valor".
+ *
+ * return: largo de la línea, como snprintf()
+ */
+int autotune_report(const struct autotune *tune, char *buffer, size_t len) {
+    struct timespec now;
+    double seconds;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seconds = elapsed(&tune->start, &now);
+    return snprintf(buffer, len, "bytes=%llu seconds=%.3f mbps=%.1f rtt_us=%u chunk=%zu buffer=%d",
+                    (unsigned long long) tune->bytes, seconds,
+                    seconds > 0 ? tune->bytes * 8 / seconds / 1e6 : 0.0,
+                    tune->rtt_us, tune->chunk, tune->buffer);
+}
@@ -0,0 +1,39 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Ajuste de una transferencia por el canal de datos. Mide el caudal y el
+ * RTT (TCP_INFO) a intervalos de un RTT y con eso elige el tamaño de cada
+ * lectura o envío y el buffer del socket (SO_SNDBUF o SO_RCVBUF), dentro
+ * de los límites de tune_limits.
+ */
+struct tune_limits {
+    size_t min_chunk, max_chunk;    // tamaño de cada lectura o envío
+    int max_buffer;                 // tope del buffer del socket; 0 lo deja al kernel
+};
+
+struct autotune {
+    int sd;
+    bool sending;
+    size_t chunk;           // tamaño actual de cada lectura o envío
+    int buffer;             // buffer del socket pedido, 0 si lo maneja el kernel
+    uint32_t rtt_us;        // RTT suavizado del kernel
+    double rate;            // caudal de la última medición, en bytes/s
+    uint64_t bytes;         // total transferido
+    uint64_t window_bytes;  // transferido desde la última medición
+    struct timespec start, window_start;
+};
+
+extern struct tune_limits tune_limits;
+
+bool tune_limits_parse(const char *spec);
+void autotune_start(struct autotune *tune, int sd, bool sending);
+void autotune_update(struct autotune *tune, size_t bytes);
+int autotune_report(const struct autotune *tune, char *buffer, size_t len);
+
+#endif
@@ -0,0 +1,164 @@
+/**
+ * Benchmark: caudal con distintos RTT, con bloque fijo y con ajuste.
+ *
+ * Compara dos servidores: uno con el bloque fijo de 512 bytes y los
+ * buffers del kernel (-T 0.5:0.5:0, "fixed") y otro con el ajuste por
+ * defecto ("auto"). El cliente usa los mismos límites que el servidor de
+ * cada modo, así que los dos extremos quedan fijos o ajustados a la vez.
+ *
+ * Para cada RTT de la lista levanta ./ftpproxy (o $FTPPROXY) delante de
+ * cada servidor con ese RTT y las opciones extra de enlace, descarga
+ * `file` a /dev/null y lo sube como `file.up`. Informa el caudal y los
+ * valores que eligió el ajuste del cliente; los del servidor quedan en su
+ * archivo de métricas (-M). El RTT que mide TCP_INFO es el del tramo hasta
+ * el proxy, no el emulado.
+ *
+ * Compilación:
+ *         gcc -O2 -pthread -I. -o bench_autotune bench/bench_autotune.c ftpclient.c untar.c fdpass.c autotune.c trace.c -lz
+ * Uso (el archivo debe estar en el directorio de ambos servidores y en el
+ * actual):
+ *         ./servidor -M auto.log 2121 &
+ *         ./servidor -M fixed.log -T 0.5:0.5:0 2122 &
+ *         ./bench_autotune 127.0.0.1 2121 2122 <USER> <PASS> <FILE> 0,10,50,100 [-b rate_kbit ...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "autotune.h"
+#include "ftpclient.h"
+
+#define MAX_PROXY_ARGS 32
+
+static bool last_ok;
+
+static void done(bool ok, const char *reply, void *arg) {
+    (void) arg;
+    last_ok = ok;
+    if (!ok) warnx("transfer failed: %s", reply);
+}
+
+/**
+ * Función: start_proxy
+ * Lanza el proxy en un puerto libre y devuelve el puerto que informó.
+ */
+static int start_proxy(pid_t *pid, const char *ip, const char *port, int rtt, char **extra, int nextra) {
+    char *args[MAX_PROXY_ARGS + 8], rtt_arg[32], line[256];
+    const char *path = getenv("FTPPROXY") ? getenv("FTPPROXY") : "./ftpproxy";
+    int fds[2], n = 0, i, proxy_port;
+    FILE *out;
+
+    snprintf(rtt_arg, sizeof(rtt_arg), "%d", rtt);
+    args[n++] = (char *) path;
+    args[n++] = "-r";
+    args[n++] = rtt_arg;
+    for (i = 0; i < nextra; i++) args[n++] = extra[i];
+    args[n++] = "0";
+    args[n++] = (char *) ip;
+    args[n++] = (char *) port;
+    args[n] = NULL;
+
+    if (pipe(fds) < 0 || (*pid = fork()) < 0) err(1, "fork");
+    if (*pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(path, args);
+        err(1, "%s", path);
+    }
+    close(fds[1]);
+    out = fdopen(fds[0], "r");
+    if (fgets(line, sizeof(line), out) == NULL || sscanf(line, "listening on port %d", &proxy_port) != 1)
+        errx(1, "proxy did not start");
+    fclose(out);
+    return proxy_port;
+}
+
+/**
+ * Función: field
+ * Extrae el valor de "clave=" de una línea de métricas.
+ */
+static const char *field(const char *line, const char *key, char *value, size_t len) {
+    const char *p = strstr(line, key);
+
+    value[0] = '\0';
+    if (p != NULL) snprintf(value, len, "%.*s", (int) strcspn(p + strlen(key), " \n"), p + strlen(key));
+    return value;
+}
+
+/**
+ * Función: run
+ * Ejecuta una transferencia y muestra la línea de métricas del cliente.
+ */
+static void run(const struct ftp_server *server, int rtt, const char *mode, bool put, const char *file) {
+    struct ftp_client *client = ftp_client_new(1);
+    char line[512] = "", remote[256], mbps[32], chunk[32], buffer[32], rtt_us[32];
+    FILE *metrics = tmpfile();
+
+    if (client == NULL || metrics == NULL) err(1, "setup");
+    ftp_client_set_metrics(client, metrics);
+    snprintf(remote, sizeof(remote), "%s.up", file);
+    if (put) ftp_put(client, server, file, remote, done, NULL);
+    else ftp_get(client, server, file, "/dev/null", done, NULL);
+    ftp_client_wait(client);
+    ftp_client_free(client);
+
+    rewind(metrics);
+    if (fgets(line, sizeof(line), metrics) == NULL) line[0] = '\0';
+    fclose(metrics);
+    printf("%6d %-6s %-3s %4s %10s %9s %10s %9s\n", rtt, mode, put ? "put" : "get", last_ok ? "ok" : "fail",
+           field(line, "mbps=", mbps, sizeof(mbps)), field(line, "rtt_us=", rtt_us, sizeof(rtt_us)),
+           field(line, "chunk=", chunk, sizeof(chunk)), field(line, "buffer=", buffer, sizeof(buffer)));
+    fflush(stdout);
+}
+
+/**
+ * Función: measure
+ * Mide un modo con un RTT: proxy delante de su servidor, GET y PUT.
+ */
+static void measure(struct ftp_server *server, const char *ip, const char *port, int rtt, const char *mode,
+                    const char *file, char **extra, int nextra) {
+    pid_t proxy;
+
+    server->addr.sin_port = htons(start_proxy(&proxy, ip, port, rtt, extra, nextra));
+    run(server, rtt, mode, false, file);
+    run(server, rtt, mode, true, file);
+    kill(proxy, SIGTERM);
+    waitpid(proxy, NULL, 0);
+}
+
+int main(int argc, char *argv[]) {
+    struct ftp_server server;
+    struct tune_limits automatic = tune_limits, fixed = { 512, 512, 0 };
+    char *rtts, *token;
+    int rtt;
+
+    if (argc < 8) errx(1, "usage: bench_autotune <ip> <auto_port> <fixed_port> <user> <pass> <file> "
+                          "<rtt_ms,...> [ftpproxy options...]");
+    if (argc - 8 > MAX_PROXY_ARGS) errx(1, "too many proxy options");
+
+    memset(&server, 0, sizeof(server));
+    server.addr.sin_family = AF_INET;
+    server.addr.sin_addr.s_addr = inet_addr(argv[1]);
+    snprintf(server.user, sizeof(server.user), "%s", argv[4]);
+    snprintf(server.pass, sizeof(server.pass), "%s", argv[5]);
+
+    printf("rtt_ms mode   op  res       mbps    rtt_us      chunk    buffer\n");
+    rtts = strdup(argv[7]);
+    for (token = strtok(rtts, ","); token != NULL; token = strtok(NULL, ",")) {
+        rtt = atoi(token);
+        tune_limits = fixed;
+        measure(&server, argv[1], argv[3], rtt, "fixed", argv[6], argv + 8, argc - 8);
+        tune_limits = automatic;
+        measure(&server, argv[1], argv[2], rtt, "auto", argv[6], argv + 8, argc - 8);
+    }
+    free(rtts);
+    return 0;
+}
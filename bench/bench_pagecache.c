@@ -0,0 +1,208 @@
+/**
+ * Benchmark: latencia de archivos pequeños y calientes durante RETR masivos.
+ *
+ * Mide la latencia de RETR de archivos elegidos al azar del árbol `dir`
+ * (p50/p99 por segundo) y qué fracción de ellos sigue en la caché de
+ * páginas (mincore). Primero `seconds` segundos sin carga y luego otros
+ * `seconds` con `bulk` sesiones descargando `bulk_file` en bucle. Con la
+ * política de E/S del servidor la latencia y la residencia deberían
+ * mantenerse; sin ella (-B muy grande) caen cuando `bulk_file` supera la
+ * memoria libre.
+ *
+ * Se ejecuta en la misma máquina que el servidor para poder consultar la
+ * caché; `dir` y `bulk_file` son rutas relativas al directorio del servidor
+ * y al actual a la vez.
+ *
+ * Compilación:
+ *         gcc -O2 -pthread -I. -o bench_pagecache bench/bench_pagecache.c ftpclient.c untar.c fdpass.c autotune.c trace.c -lz
+ * Uso:
+ *         ../servidor -u 64 2121 &                  # con la política (umbral 64 MiB)
+ *         ./bench_pagecache 127.0.0.1 2121 <USER> <PASS> tree big.bin 10 2
+ *         ../servidor -u 64 -B 1000000 2122 &       # sin descarte
+ *         ./bench_pagecache 127.0.0.1 2122 <USER> <PASS> tree big.bin 10 2
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "ftpclient.h"
+
+#define MAX_SAMPLES 100000
+#define RESIDENCY_FILES 1000
+
+static char **names;
+static size_t count, cap;
+static double samples[MAX_SAMPLES];
+static size_t nsamples;
+static long failed;
+
+static void done(bool ok, const char *reply, void *arg) {
+    (void) arg;
+    if (!ok && failed++ == 0) warnx("first failure: %s", reply);
+}
+
+/**
+ * Función: collect
+ * Lista los archivos del árbol con rutas relativas al directorio actual.
+ */
+static void collect(const char *dir) {
+    char path[FTP_PATHSIZE];
+    struct dirent *dirent;
+    struct stat st;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL) err(1, "%s", dir);
+    while ((dirent = readdir(d)) != NULL) {
+        if (dirent->d_name[0] == '.') continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, dirent->d_name) >= (int) sizeof(path)) continue;
+        if (stat(path, &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            collect(path);
+        } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            if (count == cap) {
+                cap = cap ? 2 * cap : 1024;
+                if ((names = realloc(names, cap * sizeof(*names))) == NULL) err(1, "realloc");
+            }
+            names[count++] = strdup(path);
+        }
+    }
+    closedir(d);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Función: residency
+ * Fracción de páginas en caché de una muestra fija de archivos del árbol.
+ */
+static double residency(void) {
+    size_t i, pages, resident = 0, total = 0, step = count > RESIDENCY_FILES ? count / RESIDENCY_FILES : 1, p;
+    unsigned char vec[1024];
+    struct stat st;
+    void *map;
+    int fd;
+
+    for (i = 0; i < count; i += step) {
+        if ((fd = open(names[i], O_RDONLY)) < 0) continue;
+        if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+            (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+            pages = (st.st_size + 4095) / 4096;
+            if (pages > sizeof(vec)) pages = sizeof(vec);
+            if (mincore(map, pages * 4096, vec) == 0)
+                for (p = 0; p < pages; p++, total++) resident += vec[p] & 1;
+            munmap(map, st.st_size);
+        }
+        close(fd);
+    }
+    return total ? 100.0 * resident / total : 0;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Función: measure
+ * Descarga archivos calientes de a uno durante `seconds` segundos e imprime
+ * una línea por segundo con las latencias de ese segundo.
+ */
+static void measure(struct ftp_client *client, const struct ftp_server *server, const char *phase, int seconds) {
+    double second = now(), t;
+    int elapsed = 0;
+
+    while (elapsed < seconds) {
+        t = now();
+        ftp_get(client, server, names[rand() % count], "/dev/null", done, NULL);
+        ftp_client_wait(client);
+        if (nsamples < MAX_SAMPLES) samples[nsamples++] = (now() - t) * 1000;
+
+        if (now() - second >= 1) {
+            qsort(samples, nsamples, sizeof(double), compare);
+            printf("phase=%s t=%d retr=%zu p50_ms=%.3f p99_ms=%.3f resident_pct=%.1f\n", phase, ++elapsed,
+                   nsamples, samples[nsamples / 2], samples[nsamples * 99 / 100], residency());
+            fflush(stdout);
+            second = now();
+            nsamples = 0;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct ftp_server server;
+    struct ftp_client *client;
+    pid_t bulk_pids[64];
+    int seconds, bulk, i;
+    char buffer[64 * 1024];
+    size_t j;
+    int fd;
+
+    if (argc != 9) errx(1, "usage: bench_pagecache <ip> <port> <user> <pass> <dir> <bulk_file> <seconds> <bulk>");
+    seconds = atoi(argv[7]);
+    bulk = atoi(argv[8]);
+    if (bulk < 0 || bulk > 64) errx(1, "bulk must be between 0 and 64");
+
+    memset(&server, 0, sizeof(server));
+    server.addr.sin_family = AF_INET;
+    server.addr.sin_addr.s_addr = inet_addr(argv[1]);
+    server.addr.sin_port = htons(atoi(argv[2]));
+    snprintf(server.user, sizeof(server.user), "%s", argv[3]);
+    snprintf(server.pass, sizeof(server.pass), "%s", argv[4]);
+
+    collect(argv[5]);
+    if (count == 0) errx(1, "no files in %s", argv[5]);
+    srand(1);
+
+    // Calentar el árbol: todos sus archivos en la caché antes de medir
+    for (j = 0; j < count; j++) {
+        if ((fd = open(names[j], O_RDONLY)) < 0) continue;
+        while (read(fd, buffer, sizeof(buffer)) > 0);
+        close(fd);
+    }
+
+    client = ftp_client_new(1);
+    ftp_login(client, &server, done, NULL);
+    ftp_client_wait(client);
+    if (failed) errx(1, "login failed");
+
+    measure(client, &server, "idle", seconds);
+
+    // Descargas masivas en procesos aparte para no demorar las mediciones
+    for (i = 0; i < bulk; i++) {
+        if ((bulk_pids[i] = fork()) == 0) {
+            struct ftp_client *bulk_client = ftp_client_new(1);
+
+            while (true) {
+                ftp_get(bulk_client, &server, argv[6], "/dev/null", done, NULL);
+                ftp_client_wait(bulk_client);
+            }
+        }
+        if (bulk_pids[i] < 0) err(1, "fork");
+    }
+
+    measure(client, &server, "bulk", seconds);
+
+    for (i = 0; i < bulk; i++) {
+        kill(bulk_pids[i], SIGTERM);
+        waitpid(bulk_pids[i], NULL, 0);
+    }
+    ftp_client_free(client);
+    return failed != 0;
+}
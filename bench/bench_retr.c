@@ -0,0 +1,126 @@
+/**
+ * Benchmark: RETR de archivos pequeños.
+ *
+ * Descarga `count` veces archivos del árbol `dir` (en orden aleatorio, a
+ * /dev/null) con `concurrency` sesiones del pool y reporta operaciones por
+ * segundo. Sirve para comparar el servidor leyendo del sistema de archivos
+ * con el mismo árbol empaquetado con ftppack, y TCP con el socket local
+ * (-l) si en lugar de la IP se indica su ruta.
+ *
+ * Compilación:
+ *         gcc -O2 -pthread -I. -o bench_retr bench/bench_retr.c ftpclient.c untar.c fdpass.c autotune.c trace.c -lz
+ * Uso:
+ *         ./ftppack tree.pack tree
+ *         (cd tree && ../servidor -i 64 -u 64 2121 &)                       # sistema de archivos
+ *         (cd empty && ../servidor -i 64 -u 64 -a ../tree.pack 2122 &)   # paquete
+ *         ./bench_retr 127.0.0.1 2121 <USER> <PASS> tree 100000 16
+ *         ./bench_retr 127.0.0.1 2122 <USER> <PASS> tree 100000 16
+ *         (cd tree && ../servidor -i 64 -u 64 -l /tmp/ftp.sock 2123 &)    # socket local
+ *         ./bench_retr /tmp/ftp.sock 0 <USER> <PASS> tree 100000 16
+ *
+ * El archivo ftpusers debe estar en el directorio de cada servidor.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "ftpclient.h"
+
+static char **names;
+static size_t count, cap;
+static long done_ok, done_failed;
+
+static void done(bool ok, const char *reply, void *arg) {
+    (void) arg;
+    if (ok) done_ok++;
+    else if (done_failed++ == 0) warnx("first failure: %s", reply);
+}
+
+/**
+ * Función: collect
+ * Lista los archivos del árbol con rutas relativas a su raíz.
+ */
+static void collect(const char *root, const char *rel) {
+    char dir[2 * FTP_PATHSIZE], path[FTP_PATHSIZE];
+    struct dirent *dirent;
+    struct stat st;
+    DIR *d;
+
+    snprintf(dir, sizeof(dir), "%s%s%s", root, rel[0] ? "/" : "", rel);
+    if ((d = opendir(dir)) == NULL) err(1, "%s", dir);
+    while ((dirent = readdir(d)) != NULL) {
+        if (dirent->d_name[0] == '.') continue;
+        if (snprintf(path, sizeof(path), "%s%s%s", rel, rel[0] ? "/" : "", dirent->d_name) >= (int) sizeof(path))
+            continue;
+        snprintf(dir, sizeof(dir), "%s/%s", root, path);
+        if (stat(dir, &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            collect(root, path);
+        } else if (S_ISREG(st.st_mode) && strcmp(path, "ftpusers") != 0) {
+            if (count == cap) {
+                cap = cap ? 2 * cap : 1024;
+                if ((names = realloc(names, cap * sizeof(*names))) == NULL) err(1, "realloc");
+            }
+            names[count++] = strdup(path);
+        }
+    }
+    closedir(d);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    struct ftp_server server;
+    struct ftp_client *client;
+    long total, concurrency, issued = 0, pending = 0;
+    double start, elapsed;
+
+    if (argc != 8) errx(1, "usage: bench_retr <ip|socket> <port> <user> <pass> <dir> <count> <concurrency>");
+    total = atol(argv[6]);
+    concurrency = atol(argv[7]);
+
+    memset(&server, 0, sizeof(server));
+    if (strchr(argv[1], '/') != NULL) snprintf(server.local_path, sizeof(server.local_path), "%s", argv[1]);
+    server.addr.sin_family = AF_INET;
+    server.addr.sin_addr.s_addr = inet_addr(argv[1]);
+    server.addr.sin_port = htons(atoi(argv[2]));
+    snprintf(server.user, sizeof(server.user), "%s", argv[3]);
+    snprintf(server.pass, sizeof(server.pass), "%s", argv[4]);
+
+    collect(argv[5], "");
+    if (count == 0) errx(1, "no files in %s", argv[5]);
+    srand(1);
+
+    // Las sesiones se abren antes de medir: sólo cuenta el RETR
+    client = ftp_client_new(concurrency);
+    for (issued = 0; issued < concurrency; issued++) ftp_login(client, &server, done, NULL);
+    ftp_client_wait(client);
+    if (done_failed) errx(1, "login failed");
+    done_ok = 0;
+
+    start = now();
+    issued = 0;
+    do {
+        for (; pending < concurrency && issued < total; pending++, issued++)
+            ftp_get(client, &server, names[rand() % count], "/dev/null", done, NULL);
+        pending = ftp_client_run(client, -1);
+    } while (pending > 0 || issued < total);
+    elapsed = now() - start;
+
+    printf("files=%zu retr=%ld failed=%ld concurrency=%ld seconds=%.3f retr_per_sec=%.0f\n",
+           count, done_ok, done_failed, concurrency, elapsed, done_ok / elapsed);
+
+    ftp_client_free(client);
+    return 0;
+}
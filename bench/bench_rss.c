@@ -0,0 +1,133 @@
+/**
+ * Benchmark: memoria por sesión del servidor.
+ *
+ * Abre `idle` sesiones autenticadas que quedan inactivas y `active`
+ * sesiones que descargan `file` en bucle, y suma RSS y PSS de los procesos
+ * hijos del servidor en cada fase.
+ *
+ * Compilación:
+ *         gcc -O2 -pthread -I. -o bench_rss bench/bench_rss.c ftpclient.c untar.c fdpass.c autotune.c trace.c -lz
+ * Uso (el servidor debe admitir idle + active sesiones, ver -m e -i):
+ *         ulimit -n 65536
+ *         ./servidor -m 12000 -i 12000 -u 12000 2121 &
+ *         ./bench_rss <SERVER_PID> <IP> <PORT> <USER> <PASS> <FILE> [idle] [active]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <dirent.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "ftpclient.h"
+
+#define RUN_SECONDS 5
+
+static long done_ok, done_failed;
+
+static void done(bool ok, const char *reply, void *arg) {
+    (void) reply;
+    (void) arg;
+    if (ok) done_ok++;
+    else done_failed++;
+}
+
+/**
+ * Función: proc_value
+ * Lee un campo en kB de un archivo de /proc (por ejemplo "Pss:").
+ */
+static long proc_value(const char *path, const char *field) {
+    char line[256];
+    long value = 0;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) return 0;
+    while (fgets(line, sizeof(line), file))
+        if (strncmp(line, field, strlen(field)) == 0) {
+            value = atol(line + strlen(field));
+            break;
+        }
+    fclose(file);
+    return value;
+}
+
+/**
+ * Función: measure
+ * Suma RSS y PSS de todos los procesos cuyo padre es server_pid.
+ */
+static void measure(const char *phase, long server_pid, long sessions) {
+    struct dirent *entry;
+    char path[sizeof(entry->d_name) + 32], line[256];
+    long rss = 0, pss = 0, children = 0, ppid;
+    DIR *proc = opendir("/proc");
+    FILE *file;
+
+    if (proc == NULL) err(1, "/proc");
+    while ((entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        if ((file = fopen(path, "r")) == NULL) continue;
+        ppid = -1;
+        if (fgets(line, sizeof(line), file)) sscanf(strrchr(line, ')') + 2, "%*c %ld", &ppid);
+        fclose(file);
+        if (ppid != server_pid) continue;
+
+        children++;
+        snprintf(path, sizeof(path), "/proc/%s/smaps_rollup", entry->d_name);
+        rss += proc_value(path, "Rss:");
+        pss += proc_value(path, "Pss:");
+    }
+    closedir(proc);
+
+    printf("%-8s sessions=%ld processes=%ld rss_kb=%ld pss_kb=%ld pss_per_session_kb=%.1f\n",
+           phase, sessions, children, rss, pss, children ? (double) pss / children : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    struct ftp_server server;
+    struct ftp_client *idle_client, *active_client;
+    long server_pid, idle = 10000, active = 1000, i, pending;
+    bool measured = false;
+    time_t end;
+
+    if (argc < 7) errx(1, "usage: bench_rss <server_pid> <ip> <port> <user> <pass> <file> [idle] [active]");
+    server_pid = atol(argv[1]);
+    if (argc > 7) idle = atol(argv[7]);
+    if (argc > 8) active = atol(argv[8]);
+
+    memset(&server, 0, sizeof(server));
+    server.addr.sin_family = AF_INET;
+    server.addr.sin_addr.s_addr = inet_addr(argv[2]);
+    server.addr.sin_port = htons(atoi(argv[3]));
+    snprintf(server.user, sizeof(server.user), "%s", argv[4]);
+    snprintf(server.pass, sizeof(server.pass), "%s", argv[5]);
+
+    // Fase 1: sesiones autenticadas e inactivas
+    idle_client = ftp_client_new(idle);
+    for (i = 0; i < idle; i++) ftp_login(idle_client, &server, done, NULL);
+    ftp_client_wait(idle_client);
+    if (done_failed) warnx("%ld logins failed", done_failed);
+    measure("idle", server_pid, idle);
+
+    // Fase 2: además, sesiones activas descargando en bucle
+    active_client = ftp_client_new(active);
+    for (i = 0; i < active; i++) ftp_get(active_client, &server, argv[6], "/dev/null", done, NULL);
+    end = time(NULL) + RUN_SECONDS;
+    while (time(NULL) < end) {
+        for (pending = ftp_client_run(active_client, 100); pending < active; pending++)
+            ftp_get(active_client, &server, argv[6], "/dev/null", done, NULL);
+        if (!measured && time(NULL) >= end - RUN_SECONDS / 2) {
+            measure("active", server_pid, idle + active);
+            measured = true;
+        }
+    }
+    ftp_client_wait(active_client);
+    measure("final", server_pid, idle + active);
+    printf("transfers ok=%ld failed=%ld\n", done_ok - idle, done_failed);
+
+    ftp_client_free(active_client);
+    ftp_client_free(idle_client);
+    return 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * Benchmark: matriz de transferencias sobre un enlace WAN emulado.
+ *
+ * Para cada RTT de la lista levanta ./ftpproxy (o $FTPPROXY) entre el
+ * cliente y el servidor con ese RTT y las opciones extra de enlace
+ * (caudal, jitter, pérdida). Para cada tamaño y concurrencia abre `conc`
+ * sesiones, descarga el archivo de prueba `conc` veces en paralelo y
+ * después lo sube otras tantas. Imprime una línea por celda con el
+ * tiempo total, el caudal agregado y el tiempo medio y máximo de cada
+ * transferencia, siempre en el mismo orden, así dos corridas se comparan
+ * con diff.
+ *
+ * Los archivos de prueba (wan-<size_kb>.bin) se crean en `dir`, que debe
+ * ser el directorio del servidor, y en el directorio actual para subirlos.
+ * Al terminar se borran, junto con las subidas.
+ *
+ * Compilación:
+ *         gcc -O2 -pthread -I. -o bench_wan bench/bench_wan.c ftpclient.c untar.c fdpass.c autotune.c trace.c -lz
+ * Uso:
+ *         ./servidor 2121 &
+ *         ./bench_wan 127.0.0.1 2121 <USER> <PASS> <DIR> 64,1024,16384 0,20,100 1,4 -b 100000 -p 0.1
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "ftpclient.h"
+
+#define MAX_CONC 64
+#define MAX_PROXY_ARGS 32
+
+struct transfer {
+    double start, end;
+    bool ok;
+};
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void done(bool ok, const char *reply, void *arg) {
+    struct transfer *transfer = arg;
+
+    if (transfer == NULL) {
+        if (!ok) warnx("login failed: %s", reply);
+        return;
+    }
+    transfer->end = now();
+    transfer->ok = ok;
+    if (!ok) warnx("transfer failed: %s", reply);
+}
+
+/**
+ * Función: make_file
+ * Crea un archivo de size_kb KiB con contenido pseudoaleatorio, que no
+ * se comprime ni se deduplica en el camino.
+ */
+static void make_file(const char *path, long size_kb) {
+    char block[1024];
+    long i;
+    size_t j;
+    FILE *file;
+
+    if ((file = fopen(path, "w")) == NULL) err(1, "%s", path);
+    for (i = 0; i < size_kb; i++) {
+        for (j = 0; j < sizeof(block); j++) block[j] = rand();
+        if (fwrite(block, sizeof(block), 1, file) != 1) err(1, "%s", path);
+    }
+    fclose(file);
+}
+
+/**
+ * Función: start_proxy
+ * Lanza el proxy en un puerto libre y devuelve el puerto que informó.
+ */
+static int start_proxy(pid_t *pid, const char *ip, const char *port, int rtt, char **extra, int nextra) {
+    char *args[MAX_PROXY_ARGS + 8], rtt_arg[32], line[256];
+    const char *path = getenv("FTPPROXY") ? getenv("FTPPROXY") : "./ftpproxy";
+    int fds[2], n = 0, i, proxy_port;
+    FILE *out;
+
+    snprintf(rtt_arg, sizeof(rtt_arg), "%d", rtt);
+    args[n++] = (char *) path;
+    args[n++] = "-r";
+    args[n++] = rtt_arg;
+    for (i = 0; i < nextra; i++) args[n++] = extra[i];
+    args[n++] = "0";
+    args[n++] = (char *) ip;
+    args[n++] = (char *) port;
+    args[n] = NULL;
+
+    if (pipe(fds) < 0 || (*pid = fork()) < 0) err(1, "fork");
+    if (*pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(path, args);
+        err(1, "%s", path);
+    }
+    close(fds[1]);
+    out = fdopen(fds[0], "r");
+    if (fgets(line, sizeof(line), out) == NULL || sscanf(line, "listening on port %d", &proxy_port) != 1)
+        errx(1, "proxy did not start");
+    fprintf(stderr, "proxy: %s", line);
+    fclose(out);
+    return proxy_port;
+}
+
+/**
+ * Función: run
+ * Ejecuta `conc` transferencias en paralelo por sesiones ya abiertas e
+ * imprime la línea de la celda.
+ */
+static void run(struct ftp_client *client, const struct ftp_server *server, int rtt, long size_kb, int conc,
+                bool put) {
+    struct transfer transfers[MAX_CONC];
+    char local[64], remote[64];
+    double start = now(), seconds, total = 0, max = 0;
+    int i, ok = 0;
+
+    for (i = 0; i < conc; i++) {
+        transfers[i] = (struct transfer) { start, start, false };
+        snprintf(local, sizeof(local), "wan-%ld.bin", size_kb);
+        if (put) {
+            snprintf(remote, sizeof(remote), "wan-%ld.up%d", size_kb, i);
+            ftp_put(client, server, local, remote, done, &transfers[i]);
+        } else {
+            ftp_get(client, server, local, "/dev/null", done, &transfers[i]);
+        }
+    }
+    ftp_client_wait(client);
+    seconds = now() - start;
+
+    for (i = 0; i < conc; i++) {
+        ok += transfers[i].ok;
+        total += transfers[i].end - transfers[i].start;
+        if (transfers[i].end - transfers[i].start > max) max = transfers[i].end - transfers[i].start;
+    }
+    printf("rtt_ms=%d size_kb=%ld conc=%d op=%s ok=%d/%d seconds=%.3f mbps=%.1f mean_s=%.3f max_s=%.3f\n",
+           rtt, size_kb, conc, put ? "put" : "get", ok, conc, seconds,
+           ok * size_kb * 1024 * 8 / seconds / 1e6, total / conc, max);
+    fflush(stdout);
+}
+
+/**
+ * Función: list
+ * Convierte "a,b,c" en un arreglo de enteros.
+ */
+static int list(const char *text, long *values, int max) {
+    char *copy = strdup(text), *token;
+    int n = 0;
+
+    for (token = strtok(copy, ","); token != NULL && n < max; token = strtok(NULL, ",")) values[n++] = atol(token);
+    free(copy);
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    struct ftp_server server;
+    struct ftp_client *client;
+    long sizes[16], rtts[16], concs[16];
+    int nsizes, nrtts, nconcs, s, r, c, i, proxy_port;
+    char path[FTP_PATHSIZE + 32];
+    pid_t proxy;
+
+    if (argc < 9) errx(1, "usage: bench_wan <ip> <port> <user> <pass> <dir> <size_kb,...> <rtt_ms,...> "
+                          "<conc,...> [ftpproxy options...]");
+    nsizes = list(argv[6], sizes, 16);
+    nrtts = list(argv[7], rtts, 16);
+    nconcs = list(argv[8], concs, 16);
+    if (argc - 9 > MAX_PROXY_ARGS) errx(1, "too many proxy options");
+    for (c = 0; c < nconcs; c++)
+        if (concs[c] < 1 || concs[c] > MAX_CONC) errx(1, "concurrency must be between 1 and %d", MAX_CONC);
+
+    memset(&server, 0, sizeof(server));
+    server.addr.sin_family = AF_INET;
+    server.addr.sin_addr.s_addr = inet_addr(argv[1]);
+    snprintf(server.user, sizeof(server.user), "%s", argv[3]);
+    snprintf(server.pass, sizeof(server.pass), "%s", argv[4]);
+
+    // Archivos de prueba: en el servidor para RETR y acá para STOR
+    srand(1);
+    for (s = 0; s < nsizes; s++) {
+        snprintf(path, sizeof(path), "%s/wan-%ld.bin", argv[5], sizes[s]);
+        make_file(path, sizes[s]);
+        snprintf(path, sizeof(path), "wan-%ld.bin", sizes[s]);
+        if (access(path, F_OK) != 0) make_file(path, sizes[s]);
+    }
+
+    for (r = 0; r < nrtts; r++) {
+        proxy_port = start_proxy(&proxy, argv[1], argv[2], rtts[r], argv + 9, argc - 9);
+        server.addr.sin_port = htons(proxy_port);
+
+        for (s = 0; s < nsizes; s++) {
+            for (c = 0; c < nconcs; c++) {
+                // Sesiones abiertas antes de medir: el login no entra en la celda
+                client = ftp_client_new(concs[c]);
+                for (i = 0; i < concs[c]; i++) ftp_login(client, &server, done, NULL);
+                ftp_client_wait(client);
+                run(client, &server, rtts[r], sizes[s], concs[c], false);
+                run(client, &server, rtts[r], sizes[s], concs[c], true);
+                ftp_client_free(client);
+            }
+        }
+        kill(proxy, SIGTERM);
+        waitpid(proxy, NULL, 0);
+    }
+
+    for (s = 0; s < nsizes; s++) {
+        snprintf(path, sizeof(path), "%s/wan-%ld.bin", argv[5], sizes[s]);
+        unlink(path);
+        snprintf(path, sizeof(path), "wan-%ld.bin", sizes[s]);
+        unlink(path);
+        for (i = 0; i < MAX_CONC; i++) {
+            snprintf(path, sizeof(path), "%s/wan-%ld.up%d", argv[5], sizes[s], i);
+            unlink(path);
+        }
+    }
+    return 0;
+}
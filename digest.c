@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "digest.h"
+
+#define DIGEST_MAGIC "FTPDGST1"
+#define MAX_PROBE 32
+#define MAX_SPINS 1000
+#define MAX_YIELDS 10000        // luego de las vueltas, cede el procesador al escritor
+#define READSIZE (64 * 1024)
+
+/**
+ * Índice persistente: un archivo auxiliar mapeado en memoria compartida,
+ * de modo que lo ven el proceso principal, sus hilos y todos los hijos.
+ * Es una tabla hash de direccionamiento abierto indexada por la ruta; cada
+ * entrada guarda inodo, mtime y tamaño del archivo cuando se calculó, y
+ * sólo es válida si coinciden con el stat() actual. Nada se borra: la
+ * casilla de un archivo que ya no existe, o que cambió, se reutiliza
+ * cuando otra ruta de su sondeo la necesita.
+ */
+struct digest_header {
+    char magic[8];
+    uint32_t capacity;
+    uint32_t reserved;
+};
+
+struct digest_entry {
+    uint64_t key;           // hash de la ruta, 0 = libre
+    uint32_t seq;           // seqlock: impar mientras se escribe
+    uint32_t crc;
+    uint64_t ino;
+    int64_t mtime_ns;
+    int64_t size;
+    uint8_t sha256[SHA256_SIZE];
+    char path[DIGEST_PATHSIZE];
+};
+
+static struct digest_entry *entries;
+static unsigned capacity;
+
+// Cola de archivos a calcular por los hilos en segundo plano
+struct work {
+    struct work *next;
+    char path[];
+};
+
+static struct work *queue_head, **queue_tail = &queue_head;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+// Directorios vigilados con inotify, indexados por descriptor de vigilancia
+static int inotify_fd = -1;
+static char **watch_paths;
+static int watch_cap;
+
+/**
+ * Función: digest_open
+ * --------------------
+ * Abre (o crea) el índice auxiliar y lo mapea en memoria compartida. Debe
+ * llamarse antes de crear los procesos hijos.
+ *
+ * index_path: ruta del archivo auxiliar
+ * size: entradas del índice si hay que crearlo
+ *
+ * return: true si el índice quedó disponible
+ */
+bool digest_open(const char *index_path, unsigned size) {
+    struct digest_header *header;
+    struct stat st;
+    size_t length;
+    int fd;
+
+    if ((fd = open(index_path, O_RDWR | O_CREAT, 0600)) < 0 || fstat(fd, &st) < 0) {
+        warn("Error opening digest index %s", index_path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    if (st.st_size == 0) {
+        length = sizeof(*header) + (size_t) size * sizeof(struct digest_entry);
+        if (ftruncate(fd, length) < 0) {
+            warn("Error sizing digest index");
+            close(fd);
+            return false;
+        }
+    } else {
+        length = st.st_size;
+    }
+
+    header = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        warn("Error mapping digest index");
+        return false;
+    }
+
+    if (st.st_size == 0) {
+        memcpy(header->magic, DIGEST_MAGIC, sizeof(header->magic));
+        header->capacity = size;
+    } else if (memcmp(header->magic, DIGEST_MAGIC, sizeof(header->magic)) != 0 ||
+               length < sizeof(*header) + (size_t) header->capacity * sizeof(struct digest_entry)) {
+        warnx("Invalid digest index %s", index_path);
+        munmap(header, length);
+        return false;
+    }
+
+    capacity = header->capacity;
+    entries = (struct digest_entry *) (header + 1);
+    return true;
+}
+
+/**
+ * Función: normalize
+ * ------------------
+ * Quita los "./" iniciales para que una misma ruta tenga una sola clave.
+ */
+static const char *normalize(const char *path) {
+    while (path[0] == '.' && path[1] == '/') path += 2;
+    return path;
+}
+
+/**
+ * Función: read_entry
+ * -------------------
+ * Copia la entrada con el seqlock.
+ *
+ * seq: número de secuencia de la copia, para escribir la entrada sólo si
+ * nadie la cambió desde entonces
+ *
+ * return: false si un escritor que murió a mitad de escritura la dejó
+ * inservible
+ */
+static bool read_entry(struct digest_entry *entry, struct digest_entry *copy, uint32_t *seq) {
+    int spins = 0;
+
+    do {
+        // Un escritor desalojado a mitad de escritura termina enseguida si
+        // se le cede el procesador; uno que murió no termina nunca
+        while ((*seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE)) & 1) {
+            if (++spins > MAX_SPINS + MAX_YIELDS) return false;
+            if (spins > MAX_SPINS) sched_yield();
+        }
+        memcpy(copy, entry, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != *seq);
+    return true;
+}
+
+static bool matches(const struct digest_entry *copy, const char *path, uint64_t key) {
+    return copy->key == key && strncmp(copy->path, path, DIGEST_PATHSIZE) == 0;
+}
+
+static bool current(const struct digest_entry *copy, const struct stat *st) {
+    return copy->ino == st->st_ino && copy->size == st->st_size &&
+           copy->mtime_ns == st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/**
+ * Función: find
+ * -------------
+ * Busca la entrada de la ruta con sondeo lineal acotado, sin reservar nada:
+ * las casillas sólo se ocupan en store(), con el resultado ya calculado.
+ * Las claves nunca vuelven a 0, así que una casilla libre termina la
+ * búsqueda.
+ *
+ * copy: copia consistente de la entrada encontrada
+ *
+ * return: true si la ruta tiene entrada
+ */
+static bool find(const char *path, uint64_t key, struct digest_entry *copy) {
+    uint32_t seq;
+    unsigned i;
+
+    for (i = 0; i < MAX_PROBE && i < capacity; i++) {
+        if (!read_entry(&entries[(key + i) % capacity], copy, &seq)) continue;
+        if (matches(copy, path, key)) return true;
+        if (copy->key == 0) return false;
+    }
+    return false;
+}
+
+/**
+ * Función: stale
+ * --------------
+ * Una entrada se puede reutilizar para otra ruta si ya no describe un
+ * archivo existente: se borró, se reemplazó o cambió sin que nadie la
+ * recalculara. También las que quedaron sin ruta.
+ */
+static bool stale(const struct digest_entry *copy) {
+    struct stat st;
+
+    return copy->path[0] == '\0' || stat(copy->path, &st) < 0 || !S_ISREG(st.st_mode) || !current(copy, &st);
+}
+
+/**
+ * Función: store
+ * --------------
+ * Guarda el resultado en la entrada de la ruta o, si no tiene, en la
+ * primera casilla libre o vencida de su sondeo. Clave, ruta y hashes se
+ * escriben juntos dentro del seqlock, y sólo si la casilla no cambió desde
+ * que se eligió; si otro proceso ganó la casilla se vuelve a buscar, así
+ * dos cálculos simultáneos de la misma ruta terminan en la misma entrada.
+ */
+static void store(const char *path, uint64_t key, const struct stat *st, const struct digest *digest) {
+    struct digest_entry copy, *entry, *target;
+    uint32_t seq, target_seq = 0;
+    unsigned i, attempt;
+
+    for (attempt = 0; attempt < MAX_PROBE; attempt++) {
+        target = NULL;
+        for (i = 0; i < MAX_PROBE && i < capacity; i++) {
+            entry = &entries[(key + i) % capacity];
+            if (!read_entry(entry, &copy, &seq)) continue;
+            if (matches(&copy, path, key)) {
+                target = entry;
+                target_seq = seq;
+                break;
+            }
+            if (target == NULL && (copy.key == 0 || stale(&copy))) {
+                target = entry;
+                target_seq = seq;
+            }
+            if (copy.key == 0) break;
+        }
+        if (target == NULL) return;
+
+        if (__atomic_compare_exchange_n(&target->seq, &target_seq, target_seq + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            target->key = key;
+            snprintf(target->path, DIGEST_PATHSIZE, "%s", path);
+            target->ino = st->st_ino;
+            target->size = st->st_size;
+            target->mtime_ns = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+            target->crc = digest->crc;
+            memcpy(target->sha256, digest->sha256, SHA256_SIZE);
+            __atomic_store_n(&target->seq, target_seq + 2, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+/**
+ * Función: compute
+ * ----------------
+ * Calcula CRC-32 y SHA-256 leyendo el archivo una sola vez. Se descarta si
+ * el archivo cambió mientras se leía.
+ */
+static bool compute(const char *path, struct stat *st, struct digest *out) {
+    struct sha256_ctx ctx;
+    struct stat after;
+    char buffer[READSIZE];
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) return false;
+    if (fstat(fd, st) < 0) {
+        close(fd);
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    out->crc = 0;
+    sha256_init(&ctx);
+    while ((n = read(fd, buffer, READSIZE)) > 0) {
+        out->crc = crc32_update(out->crc, buffer, n);
+        sha256_update(&ctx, buffer, n);
+    }
+    sha256_final(&ctx, out->sha256);
+
+    if (n < 0 || fstat(fd, &after) < 0 || after.st_size != st->st_size ||
+        after.st_mtim.tv_sec != st->st_mtim.tv_sec || after.st_mtim.tv_nsec != st->st_mtim.tv_nsec) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+/**
+ * Función: digest_lookup
+ * ----------------------
+ * Devuelve los hashes del archivo. Si el índice no tiene una entrada
+ * vigente los calcula en el momento y la guarda.
+ *
+ * path: ruta del archivo
+ * out: donde se guardan los hashes
+ *
+ * return: false si el archivo no existe, no es regular o no se pudo leer
+ */
+bool digest_lookup(const char *path, struct digest *out) {
+    struct digest_entry copy;
+    struct stat st;
+    uint64_t key = 0;
+
+    path = normalize(path);
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) return false;
+
+    if (entries != NULL && strlen(path) < DIGEST_PATHSIZE) {
+        key = fnv1a64(path) | 1;
+        if (find(path, key, &copy) && current(&copy, &st)) {
+            out->crc = copy.crc;
+            memcpy(out->sha256, copy.sha256, SHA256_SIZE);
+            return true;
+        }
+    }
+
+    // Un archivo que cambia mientras se lee no se guarda ni ocupa casilla
+    if (!compute(path, &st, out)) return false;
+    if (key != 0) store(path, key, &st, out);
+    return true;
+}
+
+/**
+ * Función: enqueue
+ * ----------------
+ * Agrega un archivo a la cola de cálculo en segundo plano.
+ */
+static void enqueue(const char *path) {
+    struct work *work = malloc(sizeof(*work) + strlen(path) + 1);
+
+    if (work == NULL) return;
+    strcpy(work->path, path);
+    work->next = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    *queue_tail = work;
+    queue_tail = &work->next;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Función: worker
+ * ---------------
+ * Hilo de cálculo: toma archivos de la cola y actualiza el índice.
+ */
+static void *worker(void *arg) {
+    struct digest digest;
+    struct work *work;
+
+    (void) arg;
+    while (true) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL) pthread_cond_wait(&queue_cond, &queue_lock);
+        work = queue_head;
+        queue_head = work->next;
+        if (queue_head == NULL) queue_tail = &queue_head;
+        pthread_mutex_unlock(&queue_lock);
+
+        digest_lookup(work->path, &digest);
+        free(work);
+    }
+    return NULL;
+}
+
+/**
+ * Función: join_path
+ * ------------------
+ * Arma dir/name omitiendo el directorio raíz ".".
+ *
+ * return: false si la ruta no entra en el buffer
+ */
+static bool join_path(char *out, size_t size, const char *dir, const char *name) {
+    int len;
+
+    if (strcmp(dir, ".") == 0) len = snprintf(out, size, "%s", name);
+    else len = snprintf(out, size, "%s/%.*s", dir, (int) (size - 1), name);
+    return len >= 0 && (size_t) len < size;
+}
+
+/**
+ * Función: crawl
+ * --------------
+ * Recorre el árbol vigilando cada directorio y encolando cada archivo.
+ * Los archivos ocultos (como el propio índice) se omiten.
+ */
+static void crawl(const char *dir) {
+    char path[DIGEST_PATHSIZE];
+    struct dirent *dirent;
+    struct stat st;
+    DIR *d;
+    int wd;
+
+    wd = inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    if (wd >= 0) {
+        if (wd >= watch_cap) {
+            int cap = wd + 64;
+            char **paths = realloc(watch_paths, cap * sizeof(*paths));
+
+            if (paths == NULL) return;
+            memset(paths + watch_cap, 0, (cap - watch_cap) * sizeof(*paths));
+            watch_paths = paths;
+            watch_cap = cap;
+        }
+        free(watch_paths[wd]);
+        watch_paths[wd] = strdup(dir);
+    }
+
+    if ((d = opendir(dir)) == NULL) return;
+    while ((dirent = readdir(d)) != NULL) {
+        if (dirent->d_name[0] == '.') continue;
+        if (!join_path(path, sizeof(path), dir, dirent->d_name) || lstat(path, &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) crawl(path);
+        else if (S_ISREG(st.st_mode)) enqueue(path);
+    }
+    closedir(d);
+}
+
+/**
+ * Función: watcher
+ * ----------------
+ * Hilo de inotify: recalcula los archivos modificados o movidos al árbol y
+ * vigila los directorios nuevos.
+ */
+static void *watcher(void *arg) {
+    char buffer[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[DIGEST_PATHSIZE];
+    struct inotify_event *event;
+    ssize_t len, i;
+
+    crawl(arg);
+    while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (i = 0; i < len; i += sizeof(*event) + event->len) {
+            event = (struct inotify_event *) (buffer + i);
+            if (event->mask & IN_IGNORED) {
+                if (event->wd < watch_cap) {
+                    free(watch_paths[event->wd]);
+                    watch_paths[event->wd] = NULL;
+                }
+                continue;
+            }
+            if (event->len == 0 || event->name[0] == '.' ||
+                event->wd >= watch_cap || watch_paths[event->wd] == NULL)
+                continue;
+
+            if (!join_path(path, sizeof(path), watch_paths[event->wd], event->name)) continue;
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) crawl(path);
+            } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                enqueue(path);
+            }
+        }
+    }
+    warn("digest watcher stopped");
+    return NULL;
+}
+
+/**
+ * Función: digest_start
+ * ---------------------
+ * Inicia el cálculo en segundo plano del árbol root con threads hilos y la
+ * vigilancia con inotify. Los hilos se crean con las señales bloqueadas
+ * para que SIGCHLD siga llegando al hilo principal.
+ *
+ * return: true si se iniciaron los hilos
+ */
+bool digest_start(const char *root, int threads) {
+    sigset_t all, prev;
+    pthread_t thread;
+    bool ok = true;
+
+    if (entries == NULL) return false;
+    if ((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        warn("Error starting inotify");
+        return false;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+    while (threads-- > 0 && ok)
+        ok = pthread_create(&thread, NULL, worker, NULL) == 0 && pthread_detach(thread) == 0;
+    if (ok) ok = pthread_create(&thread, NULL, watcher, (void *) root) == 0 && pthread_detach(thread) == 0;
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+
+    if (!ok) warnx("Error starting digest threads");
+    return ok;
+}
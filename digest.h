@@ -0,0 +1,21 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+#define DIGEST_CAPACITY 65536   // entradas del índice por defecto
+#define DIGEST_PATHSIZE 256
+
+struct digest {
+    uint32_t crc;
+    uint8_t sha256[SHA256_SIZE];
+};
+
+bool digest_open(const char *index_path, unsigned capacity);
+bool digest_lookup(const char *path, struct digest *out);
+bool digest_start(const char *root, int threads);
+
+#endif
@@ -0,0 +1,143 @@
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "fdpass.h"
+
+static bool make_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        warnx("Unix socket path too long: %s", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+/**
+ * Función: unix_listen
+ * --------------------
+ * Crea un socket Unix de escucha en path. Reemplaza un socket anterior
+ * que haya quedado.
+ *
+ * mask: umask con la que se crea el archivo del socket
+ *
+ * return: descriptor de escucha, -1 si hubo error
+ */
+int unix_listen(const char *path, mode_t mask) {
+    struct sockaddr_un addr;
+    mode_t old;
+    int sd;
+
+    if (!make_addr(&addr, path)) return -1;
+    if ((sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        warn("Cannot create Unix socket");
+        return -1;
+    }
+
+    unlink(path);
+    old = umask(mask);
+    if (bind(sd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sd, SOMAXCONN) < 0) {
+        warn("Cannot listen on %s", path);
+        umask(old);
+        close(sd);
+        return -1;
+    }
+    umask(old);
+    return sd;
+}
+
+/**
+ * Función: unix_connect
+ * ---------------------
+ * Se conecta a un socket Unix.
+ *
+ * return: descriptor conectado, -1 si hubo error
+ */
+int unix_connect(const char *path) {
+    struct sockaddr_un addr;
+    int sd;
+
+    if (!make_addr(&addr, path)) return -1;
+    if ((sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+    if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+/**
+ * Función: fd_send
+ * ----------------
+ * Envía un buffer por un socket Unix con un descriptor adjunto
+ * (SCM_RIGHTS). El receptor obtiene su propia copia del descriptor.
+ *
+ * fd: descriptor a pasar, -1 para ninguno
+ *
+ * return: bytes enviados, -1 si hubo error
+ */
+ssize_t fd_send(int sd, const void *buffer, size_t len, int fd) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { (void *) buffer, len };
+    struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+    ssize_t sent;
+
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        hdr.msg_control = control.buffer;
+        hdr.msg_controllen = sizeof(control.buffer);
+        cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    while ((sent = sendmsg(sd, &hdr, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    return sent;
+}
+
+/**
+ * Función: fd_recv
+ * ----------------
+ * Recibe hasta len bytes y el descriptor adjunto, si lo hay. Si llegan
+ * varios se conserva el último.
+ *
+ * fd: descriptor recibido (con close-on-exec), -1 si no vino ninguno
+ *
+ * return: bytes recibidos, 0 si se cerró la conexión, -1 si hubo error
+ */
+ssize_t fd_recv(int sd, void *buffer, size_t len, int *fd) {
+    union {
+        char buffer[CMSG_SPACE(4 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { buffer, len };
+    struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+    struct cmsghdr *cmsg;
+    int fds[4], i, count;
+    ssize_t n;
+
+    *fd = -1;
+    while ((n = recvmsg(sd, &hdr, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    for (cmsg = CMSG_FIRSTHDR(&hdr); n >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        for (i = 0; i < count; i++) {
+            if (*fd >= 0) close(*fd);
+            *fd = fds[i];
+        }
+    }
+    return n;
+}
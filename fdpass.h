@@ -0,0 +1,13 @@
+#ifndef FDPASS_H
+#define FDPASS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+int unix_listen(const char *path, mode_t mask);
+int unix_connect(const char *path);
+ssize_t fd_send(int sd, const void *buffer, size_t len, int fd);
+ssize_t fd_recv(int sd, void *buffer, size_t len, int *fd);
+
+#endif
@@ -0,0 +1,994 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "autotune.h"
+#include "fdpass.h"
+#include "ftpclient.h"
+#include "trace.h"
+#include "untar.h"
+
+#define BUFSIZE 512 // respuestas del canal de control
+#define COPY_CHUNK (4 * 1024 * 1024) // copia local entre vueltas del bucle de eventos
+
+/**
+ * Estados de una sesión de control. Cada estado que espera una respuesta
+ * del servidor la procesa en conn_reply().
+ */
+enum conn_state {
+    CS_CONNECTING,  // connect() no bloqueante en curso
+    CS_GREETING,    // espera 220
+    CS_USER,        // espera 331
+    CS_PASS,        // espera 230
+    CS_IDLE,        // autenticada, disponible en el pool
+    CS_PORT,        // espera 200
+    CS_COMMAND,     // espera 299 o 150 (RETR), 150 (STOR) o 213 (HASH)
+    CS_ACCEPT,      // espera la conexión de datos del servidor
+    CS_DATA,        // transfiriendo por el canal de datos
+    CS_COPY,        // copiando del descriptor recibido (sesión local)
+    CS_COMPLETE,    // espera 226
+    CS_CLOSED       // pendiente de liberar
+};
+
+enum req_type { REQ_LOGIN, REQ_GET, REQ_PUT, REQ_HASH };
+
+struct ftp_request {
+    struct ftp_request *next;
+    enum req_type type;
+    char remote[FTP_PATHSIZE];
+    char local[FTP_PATHSIZE];
+    ftp_done_cb done;
+    void *arg;
+};
+
+struct ftp_pool;
+
+struct ftp_conn {
+    struct ftp_conn *next;
+    struct ftp_pool *pool;
+    enum conn_state state;
+    int sd, lsd, dsd;               // control, escucha de datos y datos
+    struct ftp_request *req;        // operación en curso, NULL si está libre
+    bool failed;                    // la transferencia falló del lado local
+    FILE *file;
+    long remaining;
+    off_t copy_off;                 // posición de lectura en el descriptor recibido
+    int passed_fd;                  // descriptor recibido con una respuesta, -1 si ninguno
+    struct untar *untar;            // descarga de un directorio como tar
+    char in[2 * BUFSIZE];           // respuestas recibidas sin procesar
+    size_t in_len;
+    struct autotune tune;           // ajuste del canal de datos en curso
+    bool tuned;                     // la operación usó el canal de datos
+    char *data;                     // buffer de datos, del tamaño máximo de bloque
+    size_t data_size;
+    uint64_t trace_start;           // inicio de la operación en curso (trazas)
+    uint64_t phase_start;           // inicio del login o de la espera del canal de datos
+    size_t data_len, data_off;      // datos leídos del archivo sin enviar (put)
+};
+
+/**
+ * Sesiones y operaciones pendientes de un servidor y usuario.
+ */
+struct ftp_pool {
+    struct ftp_pool *next;
+    struct ftp_server server;
+    struct ftp_conn *conns;
+    int nconns;
+    struct ftp_request *queue, **queue_tail;
+};
+
+struct ftp_client {
+    struct ftp_pool *pools;
+    int max_per_server;
+    int pending;                    // operaciones encoladas o en curso
+    FILE *log;
+    FILE *metrics;                  // una línea por transferencia, NULL sin métricas
+    struct pollfd *pfds;
+    struct ftp_conn **owners;
+    size_t cap;
+    // Sesiones y operaciones terminadas, recicladas para no fragmentar el heap
+    struct ftp_conn *free_conns;
+    struct ftp_request *free_reqs;
+};
+
+static void pool_dispatch(struct ftp_client *client, struct ftp_pool *pool);
+
+/**
+ * Función: ftp_client_new
+ * -----------------------
+ * Crea un cliente sin sesiones abiertas.
+ *
+ * max_per_server: máximo de sesiones simultáneas por servidor y usuario
+ */
+struct ftp_client *ftp_client_new(int max_per_server) {
+    struct ftp_client *client = calloc(1, sizeof(*client));
+
+    if (client == NULL) return NULL;
+    client->max_per_server = max_per_server > 0 ? max_per_server : 1;
+    return client;
+}
+
+void ftp_client_set_log(struct ftp_client *client, FILE *log) {
+    client->log = log;
+}
+
+/**
+ * Función: ftp_client_set_metrics
+ * -------------------------------
+ * Escribe en metrics una línea "clave=valor" por cada transferencia por el
+ * canal de datos, con el bloque y el buffer del socket que eligió el
+ * ajuste, el RTT y el caudal.
+ */
+void ftp_client_set_metrics(struct ftp_client *client, FILE *metrics) {
+    client->metrics = metrics;
+}
+
+/**
+ * Función: req_alloc
+ * ------------------
+ * Toma una operación de la lista de recicladas o reserva una nueva.
+ */
+static struct ftp_request *req_alloc(struct ftp_client *client) {
+    struct ftp_request *req = client->free_reqs;
+
+    if (req == NULL) return malloc(sizeof(*req));
+    client->free_reqs = req->next;
+    return req;
+}
+
+static void req_free(struct ftp_client *client, struct ftp_request *req) {
+    req->next = client->free_reqs;
+    client->free_reqs = req;
+}
+
+/**
+ * Función: conn_alloc
+ * -------------------
+ * Toma una sesión de la lista de recicladas o reserva una nueva.
+ */
+static struct ftp_conn *conn_alloc(struct ftp_client *client) {
+    struct ftp_conn *conn = client->free_conns;
+
+    if (conn == NULL) {
+        if ((conn = malloc(sizeof(*conn))) != NULL) {
+            conn->data = NULL;
+            conn->data_size = 0;
+        }
+        return conn;
+    }
+    client->free_conns = conn->next;
+    return conn;
+}
+
+static void conn_free(struct ftp_client *client, struct ftp_conn *conn) {
+    conn->next = client->free_conns;
+    client->free_conns = conn;
+}
+
+/**
+ * Función: finish
+ * ---------------
+ * Completa la operación en curso de la sesión e invoca su callback.
+ */
+static void finish(struct ftp_client *client, struct ftp_conn *conn, bool ok, const char *reply) {
+    static const char *names[] = { [REQ_LOGIN] = "login", [REQ_GET] = "get", [REQ_PUT] = "put", [REQ_HASH] = "hash" };
+    struct ftp_request *req = conn->req;
+    char report[BUFSIZE];
+
+    if (req != NULL) TRACE_END(names[req->type], conn->trace_start, conn->tuned ? conn->tune.bytes : 0);
+
+    if (conn->tuned && client->metrics && req != NULL) {
+        autotune_report(&conn->tune, report, sizeof(report));
+        fprintf(client->metrics, "op=%s path=%s ok=%d %s\n",
+                req->type == REQ_GET ? "GET" : "PUT", req->remote, ok, report);
+    }
+    conn->tuned = false;
+
+    if (conn->file) fclose(conn->file);
+    conn->file = NULL;
+    untar_free(conn->untar);
+    conn->untar = NULL;
+    if (conn->dsd >= 0) close(conn->dsd);
+    if (conn->lsd >= 0) close(conn->lsd);
+    if (conn->passed_fd >= 0) close(conn->passed_fd);
+    conn->dsd = conn->lsd = conn->passed_fd = -1;
+    conn->req = NULL;
+    if (req == NULL) return;
+
+    client->pending--;
+    if (req->done) req->done(ok, reply, req->arg);
+    req_free(client, req);
+}
+
+/**
+ * Función: conn_fail
+ * ------------------
+ * Descarta la sesión por un error del canal de control. La operación en
+ * curso falla; las encoladas siguen esperando otra sesión.
+ */
+static void conn_fail(struct ftp_client *client, struct ftp_conn *conn, const char *reason) {
+    if (conn->state == CS_CLOSED) return;
+    conn->state = CS_CLOSED;
+    close(conn->sd);
+    finish(client, conn, false, reason);
+}
+
+/**
+ * Función: send_cmd_fd
+ * --------------------
+ * Envía un comando por el canal de control, con un descriptor adjunto si
+ * fd no es -1 (sólo en sesiones locales). Los comandos son cortos y
+ * entran siempre en el buffer del socket.
+ */
+static bool send_cmd_fd(struct ftp_client *client, struct ftp_conn *conn, const char *operation,
+                        const char *param, int fd) {
+    char buffer[BUFSIZE];
+    int len;
+
+    if (param != NULL)
+        len = snprintf(buffer, sizeof(buffer), "%s %s\r\n", operation, param);
+    else
+        len = snprintf(buffer, sizeof(buffer), "%s\r\n", operation);
+
+    if (fd_send(conn->sd, buffer, len, fd) != len) {
+        conn_fail(client, conn, "error sending data");
+        return false;
+    }
+    return true;
+}
+
+static bool send_cmd(struct ftp_client *client, struct ftp_conn *conn, const char *operation, const char *param) {
+    return send_cmd_fd(client, conn, operation, param, -1);
+}
+
+static bool is_local(const struct ftp_conn *conn) {
+    return conn->pool->server.local_path[0] != '\0';
+}
+
+/**
+ * Función: send_transfer
+ * ----------------------
+ * Envía el RETR o STOR de la operación en curso. En una sesión local el
+ * STOR lleva adjunto el descriptor del archivo a subir.
+ */
+static void send_transfer(struct ftp_client *client, struct ftp_conn *conn) {
+    struct ftp_request *req = conn->req;
+    char file_data[FTP_PATHSIZE + 32];
+    long f_size;
+
+    conn->phase_start = TRACE_BEGIN();
+    if (req->type == REQ_GET) {
+        if (send_cmd(client, conn, "RETR", req->remote)) conn->state = CS_COMMAND;
+        return;
+    }
+
+    fseek(conn->file, 0L, SEEK_END);
+    f_size = ftell(conn->file);
+    rewind(conn->file);
+    snprintf(file_data, sizeof(file_data), "%s//%ld", req->remote, f_size);
+    if (send_cmd_fd(client, conn, "STOR", file_data, is_local(conn) ? fileno(conn->file) : -1))
+        conn->state = CS_COMMAND;
+}
+
+/**
+ * Función: start_port
+ * -------------------
+ * Abre un socket de escucha en un puerto efímero de la misma interfaz del
+ * canal de control y lo anuncia con PORT.
+ */
+static void start_port(struct ftp_client *client, struct ftp_conn *conn) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    char desc[BUFSIZE], *dot;
+    int port;
+
+    getsockname(conn->sd, (struct sockaddr *) &addr, &addr_len);
+    addr.sin_port = 0;
+
+    if ((conn->lsd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(conn->lsd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(conn->lsd, 1) < 0 ||
+        getsockname(conn->lsd, (struct sockaddr *) &addr, &addr_len) < 0) {
+        finish(client, conn, false, "cannot listen on data channel");
+        conn->state = CS_IDLE;
+        return;
+    }
+    fcntl(conn->lsd, F_SETFL, O_NONBLOCK);
+
+    // h1,h2,h3,h4,p1,p2
+    port = ntohs(addr.sin_port);
+    snprintf(desc, sizeof(desc), "%s,%d,%d", inet_ntoa(addr.sin_addr), port / 256, port % 256);
+    while ((dot = strchr(desc, '.')) != NULL) *dot = ',';
+
+    if (send_cmd(client, conn, "PORT", desc)) conn->state = CS_PORT;
+}
+
+/**
+ * Función: data_buffer
+ * --------------------
+ * Asegura que el buffer de datos de la sesión alcance para el bloque
+ * máximo. Se conserva entre operaciones.
+ */
+static bool data_buffer(struct ftp_conn *conn) {
+    char *data;
+
+    if (conn->data_size >= tune_limits.max_chunk) return true;
+    if ((data = realloc(conn->data, tune_limits.max_chunk)) == NULL) return false;
+    conn->data = data;
+    conn->data_size = tune_limits.max_chunk;
+    return true;
+}
+
+/**
+ * Función: start_data
+ * -------------------
+ * Empieza a transferir por el canal de datos (o el pipe de una sesión
+ * local) ya abierto en dsd.
+ */
+static void start_data(struct ftp_conn *conn) {
+    fcntl(conn->dsd, F_SETFL, O_NONBLOCK);
+    conn->data_len = conn->data_off = 0;
+    autotune_start(&conn->tune, conn->dsd, conn->req->type == REQ_PUT);
+    conn->tuned = true;
+    conn->state = CS_DATA;
+}
+
+/**
+ * Función: start_request
+ * ----------------------
+ * Asigna una operación a una sesión autenticada y libre.
+ */
+static void start_request(struct ftp_client *client, struct ftp_conn *conn, struct ftp_request *req) {
+    conn->req = req;
+    conn->failed = false;
+    conn->trace_start = TRACE_BEGIN();
+
+    if ((req->type == REQ_GET || req->type == REQ_PUT) && !data_buffer(conn)) {
+        finish(client, conn, false, "out of memory");
+        return;
+    }
+
+    if (req->type == REQ_LOGIN) {
+        finish(client, conn, true, "logged in");
+        return;
+    }
+
+    if (req->type == REQ_HASH) {
+        if (send_cmd(client, conn, "HASH", req->remote)) conn->state = CS_COMMAND;
+        return;
+    }
+
+    if (req->type == REQ_PUT) {
+        conn->file = fopen(req->local, "r");
+        if (conn->file == NULL) {
+            finish(client, conn, false, "local file does not exist");
+            return;
+        }
+    }
+
+    // Las sesiones locales no usan canal de datos
+    if (is_local(conn)) send_transfer(client, conn);
+    else start_port(client, conn);
+}
+
+/**
+ * Función: conn_new
+ * -----------------
+ * Abre una nueva sesión hacia el servidor del pool con una conexión no
+ * bloqueante. La operación queda asignada y se inicia tras el login.
+ */
+static void conn_new(struct ftp_client *client, struct ftp_pool *pool, struct ftp_request *req) {
+    struct ftp_conn *conn = conn_alloc(client);
+    char *data;
+    size_t data_size;
+    int optval = 1;
+
+    if (conn == NULL) {
+        client->pending--;
+        if (req->done) req->done(false, "out of memory", req->arg);
+        req_free(client, req);
+        return;
+    }
+    data = conn->data;
+    data_size = conn->data_size;
+    memset(conn, 0, sizeof(*conn));
+    conn->data = data;
+    conn->data_size = data_size;
+    conn->pool = pool;
+    conn->req = req;
+    conn->lsd = conn->dsd = conn->passed_fd = -1;
+    conn->next = pool->conns;
+    pool->conns = conn;
+    pool->nconns++;
+
+    conn->state = CS_CONNECTING;
+    conn->phase_start = TRACE_BEGIN();
+    if (pool->server.local_path[0] != '\0') {
+        // En un socket Unix connect() termina en el acto
+        if ((conn->sd = unix_connect(pool->server.local_path)) < 0) {
+            conn->state = CS_CLOSED;
+            finish(client, conn, false, "connect failed");
+            return;
+        }
+        fcntl(conn->sd, F_SETFL, O_NONBLOCK);
+        return;
+    }
+    if ((conn->sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        conn->state = CS_CLOSED;
+        finish(client, conn, false, "socket failed");
+        return;
+    }
+    fcntl(conn->sd, F_SETFL, O_NONBLOCK);
+    setsockopt(conn->sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if (connect(conn->sd, (struct sockaddr *) &pool->server.addr, sizeof(pool->server.addr)) < 0 &&
+        errno != EINPROGRESS)
+        conn_fail(client, conn, "connect failed");
+}
+
+/**
+ * Función: conn_reply
+ * -------------------
+ * Avanza la máquina de estados de la sesión con una respuesta del servidor.
+ */
+static void conn_reply(struct ftp_client *client, struct ftp_conn *conn, int code, char *text) {
+    struct ftp_request *req = conn->req;
+
+    switch (conn->state) {
+        case CS_GREETING:
+            if (code != 220) break;
+            if (send_cmd(client, conn, "USER", conn->pool->server.user)) conn->state = CS_USER;
+            return;
+        case CS_USER:
+            if (code != 331) break;
+            if (send_cmd(client, conn, "PASS", conn->pool->server.pass)) conn->state = CS_PASS;
+            return;
+        case CS_PASS:
+            if (code != 230) break;
+            TRACE_END("login", conn->phase_start, 0);
+            conn->state = CS_IDLE;
+            if (req) start_request(client, conn, req);
+            return;
+        case CS_IDLE:
+            // Respuesta no solicitada, por ejemplo 421 por inactividad
+            conn_fail(client, conn, text);
+            return;
+        case CS_PORT:
+            if (code != 200) break;
+            send_transfer(client, conn);
+            return;
+        case CS_COMMAND:
+            if (req->type == REQ_HASH) {
+                conn->state = CS_IDLE;
+                finish(client, conn, code == 213, text);
+                return;
+            }
+            if (req->type == REQ_GET && code == 299) {
+                // "File %s size %ld bytes", con " at %llu" si el descriptor
+                // local es un paquete y el archivo empieza en ese offset
+                if (sscanf(text, "File %*s size %ld bytes", &conn->remaining) != 1 ||
+                    (conn->file = fopen(req->local, "w")) == NULL)
+                    conn->failed = true;
+                if (!is_local(conn)) {
+                    conn->state = CS_ACCEPT;
+                    return;
+                }
+                conn->copy_off = strstr(text, " at ") ? strtoll(strstr(text, " at ") + 4, NULL, 10) : 0;
+                conn->dsd = conn->passed_fd;
+                conn->passed_fd = -1;
+                if (conn->dsd < 0) conn->failed = true;
+                conn->state = conn->failed ? CS_COMPLETE : CS_COPY;
+                return;
+            }
+            if (req->type == REQ_GET && code == 150) {
+                // Directorio: tar de tamaño desconocido que se extrae en local
+                // a medida que llega; termina al cerrarse el canal de datos
+                // (en una sesión local, el pipe recibido)
+                if ((conn->untar = untar_new(req->local, strstr(text, "(tar.gz stream)") != NULL)) == NULL)
+                    conn->failed = true;
+                if (!is_local(conn)) {
+                    conn->state = CS_ACCEPT;
+                    return;
+                }
+                conn->dsd = conn->passed_fd;
+                conn->passed_fd = -1;
+                if (conn->dsd < 0 || conn->failed) {
+                    // Cerrar el pipe aborta el tar del lado del servidor
+                    conn->failed = true;
+                    conn->state = CS_COMPLETE;
+                    return;
+                }
+                start_data(conn);
+                return;
+            }
+            if (req->type == REQ_PUT && code == 150) {
+                // En una sesión local el servidor ya tiene el descriptor
+                conn->state = is_local(conn) ? CS_COMPLETE : CS_ACCEPT;
+                return;
+            }
+            // 550 y similares: la sesión sigue siendo válida
+            conn->state = CS_IDLE;
+            finish(client, conn, false, text);
+            return;
+        case CS_COMPLETE:
+            conn->state = CS_IDLE;
+            finish(client, conn, code == 226 && !conn->failed, text);
+            return;
+        default:
+            // Cualquier respuesta antes de abrir el canal de datos es un error (425)
+            conn->state = CS_IDLE;
+            finish(client, conn, false, text);
+            return;
+    }
+
+    // Respuesta inesperada durante el login o el PORT
+    if (conn->state == CS_PORT) {
+        conn->state = CS_IDLE;
+        finish(client, conn, false, text);
+    } else {
+        conn_fail(client, conn, text);
+    }
+}
+
+/**
+ * Función: conn_parse
+ * -------------------
+ * Procesa las respuestas completas acumuladas en el buffer de entrada.
+ * Durante la transferencia quedan retenidas hasta que termina el canal de
+ * datos (o la copia local), porque el 226 (o 426) puede llegar antes que
+ * los últimos bytes e incluso antes de aceptar la conexión de datos.
+ */
+static void conn_parse(struct ftp_client *client, struct ftp_conn *conn) {
+    char line[sizeof(conn->in) + 1], message[sizeof(conn->in) + 1], *end;
+    size_t len;
+    int code;
+
+    while (conn->state != CS_DATA && conn->state != CS_COPY && conn->state != CS_CLOSED &&
+           (end = memchr(conn->in, '\n', conn->in_len)) != NULL) {
+        len = end - conn->in + 1;
+        memcpy(line, conn->in, len);
+        line[len] = '\0';
+
+        message[0] = '\0';
+        if (sscanf(line, "%d %[^\r\n]", &code, message) < 1) code = 0;
+        if (conn->state == CS_ACCEPT && (code == 226 || code == 426)) break;
+
+        memmove(conn->in, conn->in + len, conn->in_len - len);
+        conn->in_len -= len;
+        if (code == 0) continue;
+        if (client->log) fprintf(client->log, "%d %s\n", code, message);
+        conn_reply(client, conn, code, message);
+    }
+}
+
+/**
+ * Función: conn_read
+ * ------------------
+ * Lee del canal de control lo que haya disponible. En una sesión local
+ * la respuesta puede traer un descriptor, que queda en passed_fd.
+ */
+static void conn_read(struct ftp_client *client, struct ftp_conn *conn) {
+    uint64_t start = TRACE_BEGIN();
+    ssize_t recv_s;
+    int fd;
+
+    if (conn->in_len == sizeof(conn->in)) {
+        conn_fail(client, conn, "reply too long");
+        return;
+    }
+    recv_s = fd_recv(conn->sd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, &fd);
+    if (fd >= 0) {
+        if (conn->passed_fd >= 0) close(conn->passed_fd);
+        conn->passed_fd = fd;
+    }
+    if (recv_s < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (recv_s <= 0) {
+        conn_fail(client, conn, "connection closed by host");
+        return;
+    }
+    conn->in_len += recv_s;
+    conn_parse(client, conn);
+    TRACE_END("recv_msg", start, recv_s);
+}
+
+/**
+ * Función: data_done
+ * ------------------
+ * Cierra el canal de datos y pasa a esperar la confirmación del servidor.
+ */
+static void data_done(struct ftp_client *client, struct ftp_conn *conn) {
+    close(conn->dsd);
+    conn->dsd = -1;
+    if (conn->file) fclose(conn->file);
+    conn->file = NULL;
+    conn->state = CS_COMPLETE;
+    conn_parse(client, conn);
+}
+
+/**
+ * Función: data_io
+ * ----------------
+ * Avanza la transferencia por el canal de datos sin bloquear.
+ */
+static void data_io(struct ftp_client *client, struct ftp_conn *conn) {
+    char *buffer = conn->data;
+    size_t chunk = conn->tune.chunk < conn->data_size ? conn->tune.chunk : conn->data_size;
+    uint64_t start = TRACE_BEGIN();
+    ssize_t n;
+
+    if (conn->req->type == REQ_GET) {
+        n = read(conn->dsd, buffer, chunk);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        TRACE_END("data_read", start, n > 0 ? n : 0);
+        if (n > 0) autotune_update(&conn->tune, n);
+        if (conn->untar) {
+            if (n > 0 && !untar_feed(conn->untar, buffer, n)) conn->failed = true;
+            if (n > 0) return;
+            if (n < 0 || !untar_finish(conn->untar)) conn->failed = true;
+            data_done(client, conn);
+            return;
+        }
+        if (n <= 0) {
+            if (conn->remaining > 0) conn->failed = true;
+            data_done(client, conn);
+            return;
+        }
+        if (conn->file && fwrite(buffer, 1, n, conn->file) != (size_t)n) conn->failed = true;
+        conn->remaining -= n;
+        if (conn->remaining <= 0) data_done(client, conn);
+        return;
+    }
+
+    if (conn->data_off == conn->data_len) {
+        conn->data_len = fread(conn->data, 1, chunk, conn->file);
+        conn->data_off = 0;
+        if (conn->data_len == 0) {
+            data_done(client, conn);
+            return;
+        }
+    }
+    n = send(conn->dsd, conn->data + conn->data_off, conn->data_len - conn->data_off, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n < 0) {
+        conn->failed = true;
+        data_done(client, conn);
+        return;
+    }
+    conn->data_off += n;
+    autotune_update(&conn->tune, n);
+    TRACE_END("data_send", start, n);
+}
+
+/**
+ * Función: copy_step
+ * ------------------
+ * Avanza la descarga local: copia un bloque del descriptor recibido al
+ * archivo dentro del kernel. Por bloques para no frenar a las demás
+ * sesiones del cliente.
+ */
+static void copy_step(struct ftp_client *client, struct ftp_conn *conn) {
+    size_t len = conn->remaining < COPY_CHUNK ? conn->remaining : COPY_CHUNK;
+    int fd = fileno(conn->file);
+    uint64_t start = TRACE_BEGIN();
+    ssize_t n;
+
+    if (len > 0) {
+        n = copy_file_range(conn->dsd, &conn->copy_off, fd, NULL, len, 0);
+        // Otro sistema de archivos o un destino especial (/dev/null)
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            n = sendfile(fd, conn->dsd, &conn->copy_off, len);
+        if (n <= 0) conn->failed = true;
+        else conn->remaining -= n;
+        TRACE_END("copy", start, n > 0 ? n : 0);
+    }
+    if (conn->remaining <= 0 || conn->failed) data_done(client, conn);
+}
+
+/**
+ * Función: conn_event
+ * -------------------
+ * Atiende un descriptor listo de la sesión.
+ */
+static void conn_event(struct ftp_client *client, struct ftp_conn *conn, int fd, short revents) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (conn->state == CS_CLOSED) return;
+
+    if (fd == conn->sd) {
+        if (conn->state == CS_CONNECTING) {
+            if (getsockopt(conn->sd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+                conn_fail(client, conn, "connect failed");
+                return;
+            }
+            conn->state = CS_GREETING;
+            return;
+        }
+        conn_read(client, conn);
+    } else if (fd == conn->lsd && conn->state == CS_ACCEPT) {
+        if ((conn->dsd = accept(conn->lsd, NULL, NULL)) < 0) return;
+        TRACE_END("data_accept", conn->phase_start, 0);
+        close(conn->lsd);
+        conn->lsd = -1;
+        start_data(conn);
+    } else if (fd == conn->dsd && conn->state == CS_DATA) {
+        data_io(client, conn);
+    }
+    (void) revents;
+}
+
+/**
+ * Función: pool_find
+ * ------------------
+ * Busca o crea el pool del servidor y usuario indicados.
+ */
+static struct ftp_pool *pool_find(struct ftp_client *client, const struct ftp_server *server) {
+    struct ftp_pool *pool;
+
+    for (pool = client->pools; pool != NULL; pool = pool->next) {
+        if (pool->server.addr.sin_addr.s_addr == server->addr.sin_addr.s_addr &&
+            pool->server.addr.sin_port == server->addr.sin_port &&
+            strcmp(pool->server.local_path, server->local_path) == 0 &&
+            strcmp(pool->server.user, server->user) == 0 &&
+            strcmp(pool->server.pass, server->pass) == 0)
+            return pool;
+    }
+
+    if ((pool = calloc(1, sizeof(*pool))) == NULL) return NULL;
+    pool->server = *server;
+    pool->queue_tail = &pool->queue;
+    pool->next = client->pools;
+    client->pools = pool;
+    return pool;
+}
+
+/**
+ * Función: pool_dispatch
+ * ----------------------
+ * Asigna las operaciones encoladas a sesiones libres, abriendo nuevas
+ * sesiones mientras no se supere el máximo por servidor.
+ */
+static void pool_dispatch(struct ftp_client *client, struct ftp_pool *pool) {
+    struct ftp_request *req;
+    struct ftp_conn *conn;
+
+    while (pool->queue != NULL) {
+        for (conn = pool->conns; conn != NULL; conn = conn->next)
+            if (conn->state == CS_IDLE && conn->req == NULL) break;
+        if (conn == NULL && pool->nconns >= client->max_per_server) return;
+
+        req = pool->queue;
+        pool->queue = req->next;
+        if (pool->queue == NULL) pool->queue_tail = &pool->queue;
+        req->next = NULL;
+
+        if (conn != NULL) start_request(client, conn, req);
+        else conn_new(client, pool, req);
+    }
+}
+
+/**
+ * Función: enqueue
+ * ----------------
+ * Encola una operación en el pool del servidor.
+ */
+static bool enqueue(struct ftp_client *client, const struct ftp_server *server, enum req_type type,
+                    const char *remote, const char *local, ftp_done_cb done, void *arg) {
+    struct ftp_pool *pool = pool_find(client, server);
+    struct ftp_request *req;
+
+    if (pool == NULL || (req = req_alloc(client)) == NULL) return false;
+    req->next = NULL;
+    req->type = type;
+    snprintf(req->remote, sizeof(req->remote), "%s", remote ? remote : "");
+    snprintf(req->local, sizeof(req->local), "%s", local ? local : "");
+    req->done = done;
+    req->arg = arg;
+
+    *pool->queue_tail = req;
+    pool->queue_tail = &req->next;
+    client->pending++;
+    pool_dispatch(client, pool);
+    return true;
+}
+
+/**
+ * Función: ftp_login
+ * ------------------
+ * Garantiza una sesión autenticada en el pool del servidor. Permite validar
+ * credenciales o precalentar el pool antes de las transferencias.
+ */
+bool ftp_login(struct ftp_client *client, const struct ftp_server *server, ftp_done_cb done, void *arg) {
+    return enqueue(client, server, REQ_LOGIN, NULL, NULL, done, arg);
+}
+
+/**
+ * Función: ftp_get
+ * ----------------
+ * Encola la descarga de remote en el archivo local. Si remote es un
+ * directorio, el servidor lo envía como tar y se extrae en el directorio
+ * local; "dir.tar.gz" lo pide comprimido.
+ */
+bool ftp_get(struct ftp_client *client, const struct ftp_server *server,
+             const char *remote, const char *local, ftp_done_cb done, void *arg) {
+    return enqueue(client, server, REQ_GET, remote, local, done, arg);
+}
+
+/**
+ * Función: ftp_put
+ * ----------------
+ * Encola la subida del archivo local como remote.
+ */
+bool ftp_put(struct ftp_client *client, const struct ftp_server *server,
+             const char *local, const char *remote, ftp_done_cb done, void *arg) {
+    return enqueue(client, server, REQ_PUT, remote, local, done, arg);
+}
+
+/**
+ * Función: ftp_hash
+ * -----------------
+ * Encola la consulta del SHA-256 de remote. La respuesta que recibe el
+ * callback tiene la forma "SHA-256 <hex> <ruta>", y permite comparar
+ * archivos sin descargarlos.
+ */
+bool ftp_hash(struct ftp_client *client, const struct ftp_server *server,
+              const char *remote, ftp_done_cb done, void *arg) {
+    return enqueue(client, server, REQ_HASH, remote, NULL, done, arg);
+}
+
+/**
+ * Función: watch
+ * --------------
+ * Agrega un descriptor al arreglo de poll().
+ */
+static bool watch(struct ftp_client *client, size_t *n, int fd, short events, struct ftp_conn *conn) {
+    if (*n == client->cap) {
+        size_t cap = client->cap ? 2 * client->cap : 16;
+        struct pollfd *pfds = realloc(client->pfds, cap * sizeof(*pfds));
+        struct ftp_conn **owners;
+
+        if (pfds == NULL) return false;
+        client->pfds = pfds;
+        if ((owners = realloc(client->owners, cap * sizeof(*owners))) == NULL) return false;
+        client->owners = owners;
+        client->cap = cap;
+    }
+    client->pfds[*n].fd = fd;
+    client->pfds[*n].events = events;
+    client->pfds[*n].revents = 0;
+    client->owners[*n] = conn;
+    (*n)++;
+    return true;
+}
+
+/**
+ * Función: reap
+ * -------------
+ * Libera las sesiones cerradas y reparte sus operaciones encoladas.
+ */
+static void reap(struct ftp_client *client) {
+    struct ftp_pool *pool;
+    struct ftp_conn **link, *conn;
+
+    for (pool = client->pools; pool != NULL; pool = pool->next) {
+        for (link = &pool->conns; (conn = *link) != NULL;) {
+            if (conn->state == CS_CLOSED) {
+                *link = conn->next;
+                pool->nconns--;
+                conn_free(client, conn);
+            } else {
+                link = &conn->next;
+            }
+        }
+        pool_dispatch(client, pool);
+    }
+}
+
+/**
+ * Función: ftp_client_run
+ * -----------------------
+ * Ejecuta una iteración del bucle de eventos: espera hasta timeout_ms
+ * (-1 sin límite) y avanza todas las sesiones listas.
+ *
+ * return: cantidad de operaciones pendientes
+ */
+int ftp_client_run(struct ftp_client *client, int timeout_ms) {
+    struct ftp_pool *pool;
+    struct ftp_conn *conn;
+    size_t n = 0, i;
+    bool copying = false;
+
+    reap(client);
+    if (client->pending == 0) return 0;
+
+    for (pool = client->pools; pool != NULL; pool = pool->next) {
+        for (conn = pool->conns; conn != NULL; conn = conn->next) {
+            watch(client, &n, conn->sd, conn->state == CS_CONNECTING ? POLLOUT : POLLIN, conn);
+            if (conn->state == CS_ACCEPT) watch(client, &n, conn->lsd, POLLIN, conn);
+            if (conn->state == CS_DATA)
+                watch(client, &n, conn->dsd, conn->req->type == REQ_GET ? POLLIN : POLLOUT, conn);
+            if (conn->state == CS_COPY) copying = true;
+        }
+    }
+
+    // Las copias locales no esperan eventos: sólo se revisan los sockets
+    if (poll(client->pfds, n, copying ? 0 : timeout_ms) > 0) {
+        for (i = 0; i < n; i++)
+            if (client->pfds[i].revents)
+                conn_event(client, client->owners[i], client->pfds[i].fd, client->pfds[i].revents);
+    }
+    for (pool = client->pools; copying && pool != NULL; pool = pool->next)
+        for (conn = pool->conns; conn != NULL; conn = conn->next)
+            if (conn->state == CS_COPY) copy_step(client, conn);
+
+    reap(client);
+    return client->pending;
+}
+
+/**
+ * Función: ftp_client_wait
+ * ------------------------
+ * Ejecuta el bucle de eventos hasta completar todas las operaciones.
+ */
+void ftp_client_wait(struct ftp_client *client) {
+    while (ftp_client_run(client, -1) > 0);
+}
+
+/**
+ * Función: ftp_client_free
+ * ------------------------
+ * Cierra todas las sesiones (con QUIT si están libres) y libera el cliente.
+ * Las operaciones pendientes se descartan.
+ */
+void ftp_client_free(struct ftp_client *client) {
+    struct ftp_pool *pool, *next_pool;
+    struct ftp_conn *conn, *next_conn;
+    struct ftp_request *req, *next_req;
+
+    for (conn = client->free_conns; conn != NULL; conn = next_conn) {
+        next_conn = conn->next;
+        free(conn->data);
+        free(conn);
+    }
+    for (req = client->free_reqs; req != NULL; req = next_req) {
+        next_req = req->next;
+        free(req);
+    }
+    for (pool = client->pools; pool != NULL; pool = next_pool) {
+        next_pool = pool->next;
+        for (conn = pool->conns; conn != NULL; conn = next_conn) {
+            next_conn = conn->next;
+            if (conn->state == CS_IDLE) send_cmd(client, conn, "QUIT", NULL);
+            if (conn->state != CS_CLOSED) {
+                conn->state = CS_CLOSED;
+                close(conn->sd);
+            }
+            if (conn->file) fclose(conn->file);
+            untar_free(conn->untar);
+            if (conn->dsd >= 0) close(conn->dsd);
+            if (conn->lsd >= 0) close(conn->lsd);
+            if (conn->passed_fd >= 0) close(conn->passed_fd);
+            free(conn->req);
+            free(conn->data);
+            free(conn);
+        }
+        for (req = pool->queue; req != NULL; req = next_req) {
+            next_req = req->next;
+            free(req);
+        }
+        free(pool);
+    }
+    free(client->pfds);
+    free(client->owners);
+    free(client);
+}
@@ -0,0 +1,52 @@
+#ifndef FTPCLIENT_H
+#define FTPCLIENT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#define FTP_PARSIZE 100
+#define FTP_PATHSIZE 256
+
+/**
+ * Servidor y credenciales. Las sesiones autenticadas se agrupan por
+ * servidor y usuario y se reutilizan entre transferencias. Si local_path
+ * no está vacío, se usa el socket Unix local del servidor en lugar de
+ * addr: las transferencias pasan descriptores y no copian datos.
+ */
+struct ftp_server {
+    struct sockaddr_in addr;
+    char local_path[FTP_PATHSIZE];
+    char user[FTP_PARSIZE];
+    char pass[FTP_PARSIZE];
+};
+
+struct ftp_client;
+
+/**
+ * Se invoca al terminar cada operación.
+ *
+ * ok: true si el servidor confirmó la operación
+ * reply: última respuesta del servidor o descripción del error
+ * arg: puntero del usuario entregado al encolar la operación
+ */
+typedef void (*ftp_done_cb)(bool ok, const char *reply, void *arg);
+
+struct ftp_client *ftp_client_new(int max_per_server);
+void ftp_client_free(struct ftp_client *client);
+void ftp_client_set_log(struct ftp_client *client, FILE *log);
+void ftp_client_set_metrics(struct ftp_client *client, FILE *metrics);
+
+bool ftp_login(struct ftp_client *client, const struct ftp_server *server,
+               ftp_done_cb done, void *arg);
+bool ftp_get(struct ftp_client *client, const struct ftp_server *server,
+             const char *remote, const char *local, ftp_done_cb done, void *arg);
+bool ftp_put(struct ftp_client *client, const struct ftp_server *server,
+             const char *local, const char *remote, ftp_done_cb done, void *arg);
+bool ftp_hash(struct ftp_client *client, const struct ftp_server *server,
+              const char *remote, ftp_done_cb done, void *arg);
+
+int ftp_client_run(struct ftp_client *client, int timeout_ms);
+void ftp_client_wait(struct ftp_client *client);
+
+#endif
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "pack.h"
+
+#define PATHSIZE 256
+#define DATA_ALIGN 8
+
+/**
+ * Empaqueta un árbol de directorios en un único archivo para que el
+ * servidor lo sirva con -a. Las rutas quedan relativas al directorio.
+ *
+ * Run with
+ *         ./ftppack <ARCHIVE> <DIR>
+ */
+
+struct file {
+    char *path;             // relativa al árbol
+    uint64_t size;
+};
+
+static struct file *files;
+static size_t count, cap;
+
+/**
+ * Función: collect
+ * Recorre el árbol agregando los archivos regulares a la lista.
+ **/
+static void collect(const char *root, const char *rel) {
+    char dir[2 * PATHSIZE], path[2 * PATHSIZE];
+    struct dirent *dirent;
+    struct stat st;
+    DIR *d;
+
+    if ((size_t) snprintf(dir, sizeof(dir), "%s%s%s", root, rel[0] ? "/" : "", rel) >= sizeof(dir)) {
+        warnx("path too long, skipped: %s/%s", root, rel);
+        return;
+    }
+    if ((d = opendir(dir)) == NULL) {
+        warn("%s", dir);
+        return;
+    }
+    while ((dirent = readdir(d)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s%s%s", rel, rel[0] ? "/" : "", dirent->d_name);
+        if (strlen(path) >= PATHSIZE) {
+            warnx("path too long, skipped: %s", path);
+            continue;
+        }
+        if ((size_t) snprintf(dir, sizeof(dir), "%s/%s", root, path) >= sizeof(dir)) {
+            warnx("path too long, skipped: %s/%s", root, path);
+            continue;
+        }
+        if (lstat(dir, &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            collect(root, path);
+        } else if (S_ISREG(st.st_mode)) {
+            if (count == cap) {
+                cap = cap ? 2 * cap : 1024;
+                if ((files = realloc(files, cap * sizeof(*files))) == NULL) err(1, "realloc");
+            }
+            files[count].path = strdup(path);
+            files[count].size = st.st_size;
+            count++;
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * Función: copy_file
+ * Copia el contenido del archivo en la posición indicada del paquete.
+ **/
+static void copy_file(int out, const char *root, const struct file *file, uint64_t offset) {
+    char path[2 * PATHSIZE];
+    loff_t off_out = offset;
+    uint64_t left = file->size;
+    ssize_t n;
+    int in;
+
+    if ((size_t) snprintf(path, sizeof(path), "%s/%s", root, file->path) >= sizeof(path))
+        errx(1, "path too long: %s/%s", root, file->path);
+    if ((in = open(path, O_RDONLY)) < 0) err(1, "%s", path);
+    while (left > 0) {
+        if ((n = copy_file_range(in, NULL, out, &off_out, left, 0)) <= 0)
+            errx(1, "%s: changed or unreadable while packing", path);
+        left -= n;
+    }
+    close(in);
+}
+
+int main(int argc, char *argv[]) {
+    struct pack_header header;
+    struct pack_slot *slots;
+    char tmp[PATHSIZE + 8];
+    uint64_t names_size = 0, offset, key, mask, i;
+    size_t f;
+    int out;
+
+    if (argc != 3)
+        errx(1, "usage: ftppack <archive> <dir>");
+
+    collect(argv[2], "");
+
+    // Tabla a lo sumo medio llena: casi siempre una sola casilla por búsqueda
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    for (header.slots = 16; header.slots < 2 * count; header.slots *= 2);
+    header.count = count;
+    for (f = 0; f < count; f++) names_size += strlen(files[f].path);
+    header.names_offset = sizeof(header) + (uint64_t) header.slots * sizeof(struct pack_slot);
+    header.data_offset = (header.names_offset + names_size + 4095) & ~4095ULL;
+
+    if ((slots = calloc(header.slots, sizeof(*slots))) == NULL) err(1, "calloc");
+    if ((size_t) snprintf(tmp, sizeof(tmp), "%s.tmp", argv[1]) >= sizeof(tmp)) errx(1, "path too long: %s", argv[1]);
+    if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) err(1, "%s", tmp);
+
+    mask = header.slots - 1;
+    names_size = 0;
+    offset = header.data_offset;
+    for (f = 0; f < count; f++) {
+        key = fnv1a64(files[f].path) | 1;
+        for (i = key & mask; slots[i].key != 0; i = (i + 1) & mask);
+        slots[i].key = key;
+        slots[i].offset = offset;
+        slots[i].size = files[f].size;
+        slots[i].name_offset = names_size;
+        slots[i].name_len = strlen(files[f].path);
+
+        if (pwrite(out, files[f].path, slots[i].name_len, header.names_offset + names_size) < 0)
+            err(1, "write names");
+        names_size += slots[i].name_len;
+
+        copy_file(out, argv[2], &files[f], offset);
+        offset = (offset + files[f].size + DATA_ALIGN - 1) & ~(uint64_t) (DATA_ALIGN - 1);
+    }
+
+    if (pwrite(out, &header, sizeof(header), 0) != sizeof(header) ||
+        pwrite(out, slots, header.slots * sizeof(*slots), sizeof(header)) < 0 ||
+        ftruncate(out, offset) < 0 || fsync(out) < 0)
+        err(1, "write index");
+    close(out);
+    if (rename(tmp, argv[1]) < 0) err(1, "rename");
+
+    printf("%zu files, %llu bytes\n", count, (unsigned long long) offset);
+    return 0;
+}
@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/**
+ * Proxy TCP que emula un enlace WAN entre el cliente y el servidor sin
+ * privilegios (a diferencia de netem). Atiende el canal de control y los
+ * de datos: reescribe los PORT del cliente y los 227 de un servidor con
+ * PASV para que las conexiones de datos también pasen por el proxy.
+ *
+ * Cada sentido del enlace tiene un retardo de la mitad del RTT, con jitter,
+ * y un caudal máximo compartido por todas las conexiones. Como el proxy no
+ * ve paquetes, una pérdida se emula como la retransmisión que produciría:
+ * el bloque afectado, y los que le siguen, se demoran un RTO.
+ *
+ * Run with
+ *         ./ftpproxy [-r rtt_ms] [-j jitter_ms] [-b rate_kbit] [-p loss_pct] [-s seed]
+ *                    <LISTEN_PORT> <SERVER_IP> <SERVER_PORT>
+ *
+ * Con LISTEN_PORT 0 se elige un puerto libre. El puerto se informa por la
+ * salida estándar en cuanto el proxy acepta conexiones.
+ */
+
+#define LINESIZE 512            // línea máxima del canal de control
+#define CHUNK_MAX (16 * 1024)   // lectura máxima por bloque
+#define CHUNK_MIN 1460          // un segmento: bloque mínimo con caudal bajo
+#define QUEUE_MIN (256 * 1024)  // bytes en vuelo por sentido, además del BDP
+#define QUEUE_UNLIMITED (16 * 1024 * 1024)
+#define RTO_MIN 200             // ms; RTO mínimo de Linux
+
+enum { UP, DOWN };              // cliente a servidor, servidor a cliente
+
+// Un sentido del enlace, compartido por todas las conexiones
+struct link {
+    uint64_t delay, jitter;     // ns
+    double rate;                // bytes/s, 0 sin límite
+    uint64_t free;              // cuándo termina de "transmitir" lo encolado
+};
+
+struct chunk {
+    struct chunk *next;
+    uint64_t deliver;           // cuándo se puede entregar
+    size_t len, off;
+    char data[];
+};
+
+/**
+ * Un sentido de una conexión: lo leído de from espera en la cola hasta su
+ * momento de entrega y recién entonces se escribe en to. Las entregas
+ * respetan el orden, como en TCP.
+ */
+struct pipe {
+    int from, to;
+    struct link *link;
+    struct chunk *head, *tail;
+    size_t queued;
+    uint64_t last;              // entrega del último bloque encolado
+    bool eof, shut;             // from terminó; to ya se cerró para escritura
+    bool blocked;               // to no acepta más por ahora: esperar POLLOUT
+    char line[LINESIZE];        // línea incompleta (canal de control)
+    size_t line_len;
+};
+
+struct conn {
+    struct conn *next;
+    int client_sd, server_sd;
+    bool control;
+    bool failed;
+    struct pipe pipes[2];
+    int data_lsd;               // escucha de datos pendiente, -1 si ninguna
+    bool passive;               // data_lsd espera al cliente (PASV) o al servidor (PORT)
+    struct sockaddr_in target;  // a dónde conectar lo que llegue a data_lsd
+};
+
+static struct link links[2];
+static double loss;
+static uint64_t rto;
+static size_t chunk_size, queue_max;
+static struct sockaddr_in server_addr;
+static struct conn *conns;
+
+// Descriptores de cada vuelta de poll() y la conexión a la que pertenecen
+static struct pollfd *pfds;
+static struct conn **owners;
+static size_t nfds, cap;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void set_nonblock(int sd) {
+    int optval = 1;
+
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+}
+
+// Conexión bloqueante: los destinos están en la red local del proxy
+static int connect_to(const struct sockaddr_in *addr) {
+    int sd;
+
+    if ((sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+    if (connect(sd, (const struct sockaddr *) addr, sizeof(*addr)) < 0) {
+        warn("Cannot connect to %s:%d", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        close(sd);
+        return -1;
+    }
+    set_nonblock(sd);
+    return sd;
+}
+
+/**
+ * Función: listen_on
+ * ------------------
+ * Abre un socket de escucha en la dirección de la interfaz de sd (la que
+ * ve el otro extremo), en un puerto libre.
+ *
+ * addr: dirección resultante
+ */
+static int listen_on(int sd, struct sockaddr_in *addr) {
+    socklen_t len = sizeof(*addr);
+    int lsd;
+
+    if (getsockname(sd, (struct sockaddr *) addr, &len) < 0) return -1;
+    addr->sin_port = 0;
+    if ((lsd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+    if (bind(lsd, (struct sockaddr *) addr, sizeof(*addr)) < 0 || listen(lsd, 1) < 0 ||
+        getsockname(lsd, (struct sockaddr *) addr, &len) < 0) {
+        close(lsd);
+        return -1;
+    }
+    fcntl(lsd, F_SETFL, O_NONBLOCK);
+    return lsd;
+}
+
+// h1,h2,h3,h4,p1,p2 <-> sockaddr_in
+static bool parse_hostport(const char *text, struct sockaddr_in *addr) {
+    unsigned h[4], p[2];
+
+    if (sscanf(text, "%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) != 6) return false;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3]);
+    addr->sin_port = htons(p[0] << 8 | p[1]);
+    return true;
+}
+
+static void format_hostport(const struct sockaddr_in *addr, char *text, size_t len) {
+    uint32_t ip = ntohl(addr->sin_addr.s_addr);
+    unsigned port = ntohs(addr->sin_port);
+
+    snprintf(text, len, "%u,%u,%u,%u,%u,%u", ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255,
+             port >> 8, port & 255);
+}
+
+/**
+ * Función: enqueue
+ * ----------------
+ * Encola len bytes para entregar cuando el enlace los haya transmitido
+ * (caudal compartido) y recorrido (retardo con jitter y, si se pierden,
+ * un RTO más).
+ */
+static bool enqueue(struct pipe *pipe, const char *data, size_t len) {
+    struct link *link = pipe->link;
+    struct chunk *chunk;
+    uint64_t now = now_ns(), sent;
+    int64_t delay = link->delay;
+
+    if (len == 0) return true;
+    if ((chunk = malloc(sizeof(*chunk) + len)) == NULL) return false;
+    memcpy(chunk->data, data, len);
+    chunk->len = len;
+    chunk->off = 0;
+    chunk->next = NULL;
+
+    sent = link->free > now ? link->free : now;
+    if (link->rate > 0) sent += len * 1e9 / link->rate;
+    link->free = sent;
+    if (link->jitter > 0) delay += (int64_t) (drand48() * 2 * link->jitter) - (int64_t) link->jitter;
+    if (delay < 0) delay = 0;
+    chunk->deliver = sent + delay;
+    if (loss > 0 && drand48() < loss) chunk->deliver += rto;
+    if (chunk->deliver < pipe->last) chunk->deliver = pipe->last;
+    pipe->last = chunk->deliver;
+
+    if (pipe->tail) pipe->tail->next = chunk;
+    else pipe->head = chunk;
+    pipe->tail = chunk;
+    pipe->queued += len;
+    return true;
+}
+
+/**
+ * Función: rewrite
+ * ----------------
+ * Reescribe una línea de control que anuncia una dirección de datos: PORT
+ * del cliente o 227 del servidor. El proxy escucha en su lugar y recuerda
+ * la dirección original para conectarse cuando llegue la conexión.
+ */
+static void rewrite(struct conn *conn, int dir, char *line, size_t size) {
+    struct sockaddr_in target, proxy;
+    char hostport[64], *open, *close_paren;
+    int lsd;
+
+    if (dir == UP && strncasecmp(line, "PORT ", 5) == 0) {
+        if (!parse_hostport(line + 5, &target) || (lsd = listen_on(conn->server_sd, &proxy)) < 0) return;
+        conn->passive = false;
+        format_hostport(&proxy, hostport, sizeof(hostport));
+        snprintf(line, size, "PORT %s\r\n", hostport);
+    } else if (dir == DOWN && strncmp(line, "227 ", 4) == 0 &&
+               (open = strchr(line, '(')) != NULL && (close_paren = strchr(open, ')')) != NULL) {
+        if (!parse_hostport(open + 1, &target) || (lsd = listen_on(conn->client_sd, &proxy)) < 0) return;
+        conn->passive = true;
+        format_hostport(&proxy, hostport, sizeof(hostport));
+        snprintf(line, size, "227 Entering Passive Mode (%s)\r\n", hostport);
+    } else {
+        return;
+    }
+    if (conn->data_lsd >= 0) close(conn->data_lsd);
+    conn->data_lsd = lsd;
+    conn->target = target;
+}
+
+/**
+ * Función: pump_in
+ * ----------------
+ * Lee lo disponible en un sentido y lo encola. En el canal de control se
+ * encolan líneas completas, ya reescritas.
+ */
+static void pump_in(struct conn *conn, int dir) {
+    struct pipe *pipe = &conn->pipes[dir];
+    char buffer[CHUNK_MAX], line[LINESIZE + 64], *end;
+    ssize_t n;
+    size_t len;
+
+    n = read(pipe->from, buffer, chunk_size);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR) conn->failed = true;
+        return;
+    }
+    if (n == 0) {
+        pipe->eof = true;
+        if (!enqueue(pipe, pipe->line, pipe->line_len)) conn->failed = true;
+        pipe->line_len = 0;
+        return;
+    }
+    if (!conn->control) {
+        if (!enqueue(pipe, buffer, n)) conn->failed = true;
+        return;
+    }
+
+    while (n > 0) {
+        len = (size_t) n < LINESIZE - pipe->line_len ? (size_t) n : LINESIZE - pipe->line_len;
+        memcpy(pipe->line + pipe->line_len, buffer, len);
+        pipe->line_len += len;
+        memmove(buffer, buffer + len, n - len);
+        n -= len;
+
+        // Líneas completas; una línea más larga que el buffer pasa tal cual
+        while ((end = memchr(pipe->line, '\n', pipe->line_len)) != NULL || pipe->line_len == LINESIZE) {
+            len = end ? (size_t) (end - pipe->line) + 1 : pipe->line_len;
+            memcpy(line, pipe->line, len);
+            line[len] = '\0';
+            if (end) rewrite(conn, dir, line, sizeof(line));
+            if (!enqueue(pipe, line, strlen(line))) conn->failed = true;
+            memmove(pipe->line, pipe->line + len, pipe->line_len - len);
+            pipe->line_len -= len;
+        }
+    }
+}
+
+/**
+ * Función: pump_out
+ * -----------------
+ * Escribe los bloques cuya hora de entrega ya pasó. Vacía la cola de un
+ * sentido que terminó, cierra el destino para escritura.
+ */
+static void pump_out(struct pipe *pipe, bool *failed, uint64_t now) {
+    struct chunk *chunk;
+    ssize_t n;
+
+    pipe->blocked = false;
+    while ((chunk = pipe->head) != NULL && chunk->deliver <= now) {
+        n = write(pipe->to, chunk->data + chunk->off, chunk->len - chunk->off);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) pipe->blocked = true;
+            else *failed = true;
+            return;
+        }
+        chunk->off += n;
+        pipe->queued -= n;
+        if (chunk->off < chunk->len) continue;
+        pipe->head = chunk->next;
+        if (pipe->head == NULL) pipe->tail = NULL;
+        free(chunk);
+    }
+    if (pipe->head == NULL && pipe->eof && !pipe->shut) {
+        shutdown(pipe->to, SHUT_WR);
+        pipe->shut = true;
+    }
+}
+
+/**
+ * Función: conn_new
+ * -----------------
+ * Registra un par de sockets conectados. Las primeras entregas esperan un
+ * RTT, lo que tardaría el handshake del enlace emulado.
+ */
+static struct conn *conn_new(int client_sd, int server_sd, bool control) {
+    struct conn *conn = calloc(1, sizeof(*conn));
+    uint64_t ready = now_ns() + links[UP].delay + links[DOWN].delay;
+
+    if (conn == NULL) {
+        close(client_sd);
+        close(server_sd);
+        return NULL;
+    }
+    conn->client_sd = client_sd;
+    conn->server_sd = server_sd;
+    conn->control = control;
+    conn->data_lsd = -1;
+    conn->pipes[UP] = (struct pipe) { .from = client_sd, .to = server_sd, .link = &links[UP], .last = ready };
+    conn->pipes[DOWN] = (struct pipe) { .from = server_sd, .to = client_sd, .link = &links[DOWN], .last = ready };
+    conn->next = conns;
+    conns = conn;
+    return conn;
+}
+
+static void conn_free(struct conn *conn) {
+    struct chunk *chunk;
+    int dir;
+
+    for (dir = UP; dir <= DOWN; dir++) {
+        while ((chunk = conn->pipes[dir].head) != NULL) {
+            conn->pipes[dir].head = chunk->next;
+            free(chunk);
+        }
+    }
+    close(conn->client_sd);
+    close(conn->server_sd);
+    if (conn->data_lsd >= 0) close(conn->data_lsd);
+    free(conn);
+}
+
+// Llega una conexión al proxy: se conecta al servidor real
+static void accept_control(int lsd) {
+    int client_sd, server_sd;
+
+    if ((client_sd = accept4(lsd, NULL, NULL, SOCK_CLOEXEC)) < 0) return;
+    if ((server_sd = connect_to(&server_addr)) < 0) {
+        close(client_sd);
+        return;
+    }
+    set_nonblock(client_sd);
+    conn_new(client_sd, server_sd, true);
+}
+
+// Llega la conexión de datos anunciada: se conecta al destino original
+static void accept_data(struct conn *ctl) {
+    int sd, other;
+
+    sd = accept4(ctl->data_lsd, NULL, NULL, SOCK_CLOEXEC);
+    close(ctl->data_lsd);
+    ctl->data_lsd = -1;
+    if (sd < 0) return;
+    if ((other = connect_to(&ctl->target)) < 0) {
+        close(sd);
+        return;
+    }
+    set_nonblock(sd);
+    if (ctl->passive) conn_new(sd, other, false);
+    else conn_new(other, sd, false);
+}
+
+// Agrega fd a la lista de poll y devuelve su índice: la lista puede moverse
+static size_t watch(int fd, short events, struct conn *owner) {
+    if (nfds == cap) {
+        cap = cap ? 2 * cap : 64;
+        if ((pfds = realloc(pfds, cap * sizeof(*pfds))) == NULL ||
+            (owners = realloc(owners, cap * sizeof(*owners))) == NULL)
+            err(1, "realloc");
+    }
+    pfds[nfds] = (struct pollfd) { .fd = fd, .events = events };
+    owners[nfds] = owner;
+    return nfds++;
+}
+
+static void usage(void) {
+    errx(1, "usage: ftpproxy [-r rtt_ms] [-j jitter_ms] [-b rate_kbit] [-p loss_pct] [-s seed]\n"
+            "\t<listen_port> <server_ip> <server_port>");
+}
+
+int main(int argc, char *argv[]) {
+    struct conn *conn, **link_ptr;
+    struct pipe *pipe;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    size_t i, ends[2];
+    double rtt_ms = 0, jitter_ms = 0, rate_kbit = 0, loss_pct = 0;
+    uint64_t now, wake;
+    int opt, lsd, dir, timeout, optval = 1;
+    long seed = 1;
+
+    while ((opt = getopt(argc, argv, "r:j:b:p:s:")) != -1) {
+        switch (opt) {
+            case 'r': rtt_ms = atof(optarg); break;
+            case 'j': jitter_ms = atof(optarg); break;
+            case 'b': rate_kbit = atof(optarg); break;
+            case 'p': loss_pct = atof(optarg); break;
+            case 's': seed = atol(optarg); break;
+            default: usage();
+        }
+    }
+    if (argc - optind != 3 || rtt_ms < 0 || jitter_ms < 0 || rate_kbit < 0 || loss_pct < 0 || loss_pct > 100)
+        usage();
+
+    // Enlace simétrico: cada sentido lleva la mitad del RTT y el jitter
+    for (dir = UP; dir <= DOWN; dir++) {
+        links[dir].delay = rtt_ms * 1e6 / 2;
+        links[dir].jitter = jitter_ms * 1e6 / 2;
+        links[dir].rate = rate_kbit * 1000 / 8;
+    }
+    loss = loss_pct / 100;
+    rto = (2 * rtt_ms > RTO_MIN ? 2 * rtt_ms : RTO_MIN) * 1e6;
+    srand48(seed);
+
+    // Bloques de ~1 ms de transmisión, para que el caudal sea parejo; la cola
+    // cubre el producto caudal x retardo, como la ventana de TCP
+    chunk_size = CHUNK_MAX;
+    queue_max = QUEUE_UNLIMITED;
+    if (links[UP].rate > 0) {
+        chunk_size = links[UP].rate / 1000;
+        if (chunk_size < CHUNK_MIN) chunk_size = CHUNK_MIN;
+        if (chunk_size > CHUNK_MAX) chunk_size = CHUNK_MAX;
+        queue_max = QUEUE_MIN + 2 * links[UP].rate * (rtt_ms + jitter_ms + (loss > 0 ? rto / 1e6 : 0)) / 1000;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[optind + 2]));
+    if (inet_aton(argv[optind + 1], &server_addr.sin_addr) == 0) errx(1, "Invalid server address");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(argv[optind]));
+    if ((lsd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) err(1, "socket");
+    setsockopt(lsd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (bind(lsd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(lsd, 128) < 0 ||
+        getsockname(lsd, (struct sockaddr *) &addr, &addr_len) < 0)
+        err(1, "Cannot listen on port %s", argv[optind]);
+    fcntl(lsd, F_SETFL, O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("listening on port %d rtt_ms=%g jitter_ms=%g rate_kbit=%g loss_pct=%g\n",
+           ntohs(addr.sin_port), rtt_ms, jitter_ms, rate_kbit, loss_pct);
+    fflush(stdout);
+
+    while (true) {
+        // Descriptores a esperar y hora de la próxima entrega pendiente
+        now = now_ns();
+        wake = UINT64_MAX;
+        nfds = 0;
+        watch(lsd, POLLIN, NULL);
+        for (conn = conns; conn != NULL; conn = conn->next) {
+            // ends[UP] es el lado del cliente y ends[DOWN] el del servidor:
+            // cada sentido lee de uno y escribe en el otro
+            ends[UP] = watch(conn->client_sd, 0, conn);
+            ends[DOWN] = watch(conn->server_sd, 0, conn);
+            for (dir = UP; dir <= DOWN; dir++) {
+                pipe = &conn->pipes[dir];
+                if (!pipe->eof && pipe->queued < queue_max) pfds[ends[dir]].events |= POLLIN;
+                if (pipe->blocked) pfds[ends[!dir]].events |= POLLOUT;
+                else if (pipe->head != NULL && pipe->head->deliver < wake) wake = pipe->head->deliver;
+            }
+            if (conn->data_lsd >= 0) watch(conn->data_lsd, POLLIN, conn);
+        }
+
+        timeout = wake == UINT64_MAX ? -1 : wake <= now ? 0 : (int) ((wake - now + 999999) / 1000000);
+        if (poll(pfds, nfds, timeout) < 0 && errno != EINTR) err(1, "poll");
+
+        if (pfds[0].revents & POLLIN) accept_control(lsd);
+        for (i = 1; i < nfds; i++) {
+            if (!pfds[i].revents || (conn = owners[i]) == NULL) continue;
+            if (pfds[i].fd == conn->data_lsd) {
+                accept_data(conn);
+                continue;
+            }
+            dir = pfds[i].fd == conn->client_sd ? UP : DOWN;
+            if (!conn->pipes[dir].eof && (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) pump_in(conn, dir);
+        }
+
+        // Entregar lo que venció y liberar las conexiones terminadas
+        now = now_ns();
+        for (link_ptr = &conns; (conn = *link_ptr) != NULL;) {
+            for (dir = UP; dir <= DOWN && !conn->failed; dir++) pump_out(&conn->pipes[dir], &conn->failed, now);
+            if (conn->failed || (conn->pipes[UP].shut && conn->pipes[DOWN].shut)) {
+                *link_ptr = conn->next;
+                conn_free(conn);
+            } else {
+                link_ptr = &conn->next;
+            }
+        }
+    }
+}
@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "fdpass.h"
+#include "handoff.h"
+
+#define HANDOFF_TIMEOUT 5 // segundos de espera de cada mensaje
+
+// Acota las esperas: el otro extremo puede morir a mitad del intercambio
+static void set_timeout(int sd) {
+    struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * Función: handoff_listen
+ * -----------------------
+ * Crea el socket Unix de actualización en path, accesible sólo por el
+ * usuario del servidor. Reemplaza un socket anterior que haya quedado.
+ *
+ * return: descriptor de escucha, -1 si hubo error
+ */
+int handoff_listen(const char *path) {
+    return unix_listen(path, 077);
+}
+
+/**
+ * Función: handoff_connect
+ * ------------------------
+ * Se conecta al socket de actualización de otro servidor.
+ *
+ * return: descriptor conectado, -1 si no hay un servidor escuchando
+ */
+int handoff_connect(const char *path) {
+    int sd;
+
+    if ((sd = unix_connect(path)) >= 0) set_timeout(sd);
+    return sd;
+}
+
+/**
+ * Función: handoff_accept
+ * -----------------------
+ * Acepta una conexión en el socket de actualización. Sólo se admiten
+ * procesos del mismo usuario.
+ *
+ * return: descriptor aceptado, -1 si hubo error o el usuario no coincide
+ */
+int handoff_accept(int lsd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int sd;
+
+    if ((sd = accept4(lsd, NULL, NULL, SOCK_CLOEXEC)) < 0) return -1;
+    if (getsockopt(sd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != geteuid()) {
+        warnx("Rejected handoff connection from uid %d", (int) cred.uid);
+        close(sd);
+        return -1;
+    }
+    set_timeout(sd);
+    return sd;
+}
+
+/**
+ * Función: handoff_send
+ * ---------------------
+ * Envía un mensaje con un descriptor adjunto.
+ *
+ * fd: descriptor a pasar, -1 para ninguno
+ */
+bool handoff_send(int sd, const struct handoff_msg *msg, int fd) {
+    return fd_send(sd, msg, sizeof(*msg), fd) == sizeof(*msg);
+}
+
+/**
+ * Función: handoff_recv
+ * ---------------------
+ * Recibe un mensaje y el descriptor adjunto, si lo hay.
+ *
+ * fd: descriptor recibido, -1 si no vino ninguno
+ */
+bool handoff_recv(int sd, struct handoff_msg *msg, int *fd) {
+    if (fd_recv(sd, msg, sizeof(*msg), fd) != sizeof(*msg)) {
+        if (*fd >= 0) close(*fd);
+        *fd = -1;
+        return false;
+    }
+    msg->user[HANDOFF_USERSIZE - 1] = '\0';
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#define HANDOFF_USERSIZE 100
+
+/**
+ * Mensajes del socket Unix de actualización. Cada mensaje puede llevar un
+ * descriptor adjunto (SCM_RIGHTS):
+ *
+ *   HANDOFF_LISTEN   el servidor nuevo pide el socket de escucha; el viejo
+ *                    responde HANDOFF_LISTEN con el descriptor adjunto y
+ *                    HANDOFF_LOCAL, con el socket local (-l) si lo tiene
+ *   HANDOFF_SESSION  un hijo del servidor viejo entrega su canal de control,
+ *                    ya autenticado como user, con la dirección del último
+ *                    PORT (sin_family 0 si no hubo)
+ *   HANDOFF_ACK      confirmación sin descriptor
+ */
+enum handoff_kind { HANDOFF_LISTEN = 'L', HANDOFF_LOCAL = 'U', HANDOFF_SESSION = 'S', HANDOFF_ACK = 'A' };
+
+struct handoff_msg {
+    char kind;
+    char user[HANDOFF_USERSIZE];
+    struct sockaddr_in data_addr;
+};
+
+int handoff_listen(const char *path);
+int handoff_connect(const char *path);
+int handoff_accept(int lsd);
+bool handoff_send(int sd, const struct handoff_msg *msg, int fd);
+bool handoff_recv(int sd, struct handoff_msg *msg, int *fd);
+
+#endif
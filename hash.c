@@ -0,0 +1,141 @@
+#include <string.h>
+
+#include "hash.h"
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * Función: sha256_block
+ * ---------------------
+ * Procesa un bloque de 64 bytes (FIPS 180-4).
+ */
+static void sha256_block(struct sha256_ctx *ctx, const uint8_t *block) {
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (; i < 64; i++)
+        w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(struct sha256_ctx *ctx) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->bits = 0;
+    ctx->len = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    size_t n;
+
+    ctx->bits += (uint64_t)len * 8;
+    while (len > 0) {
+        if (ctx->len == 0 && len >= 64) {
+            sha256_block(ctx, p);
+            p += 64;
+            len -= 64;
+            continue;
+        }
+        n = 64 - ctx->len < len ? 64 - ctx->len : len;
+        memcpy(ctx->block + ctx->len, p, n);
+        ctx->len += n;
+        p += n;
+        len -= n;
+        if (ctx->len == 64) {
+            sha256_block(ctx, ctx->block);
+            ctx->len = 0;
+        }
+    }
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t out[SHA256_SIZE]) {
+    uint64_t bits = ctx->bits;
+    int i;
+
+    ctx->block[ctx->len++] = 0x80;
+    if (ctx->len > 56) {
+        memset(ctx->block + ctx->len, 0, 64 - ctx->len);
+        sha256_block(ctx, ctx->block);
+        ctx->len = 0;
+    }
+    memset(ctx->block + ctx->len, 0, 56 - ctx->len);
+    for (i = 0; i < 8; i++) ctx->block[56 + i] = bits >> (56 - 8 * i);
+    sha256_block(ctx, ctx->block);
+
+    for (i = 0; i < 8; i++) {
+        out[4 * i] = ctx->state[i] >> 24;
+        out[4 * i + 1] = ctx->state[i] >> 16;
+        out[4 * i + 2] = ctx->state[i] >> 8;
+        out[4 * i + 3] = ctx->state[i];
+    }
+}
+
+/**
+ * Función: crc32_update
+ * ---------------------
+ * CRC-32 (IEEE 802.3, el de XCRC). Empieza con crc = 0.
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    static uint32_t table[256];
+    const uint8_t *p = data;
+    uint32_t c;
+    int i, j;
+
+    // La tabla se publica al escribir table[1], que es lo último que se
+    // completa; varios hilos pueden calcularla a la vez sin conflicto
+    if (__atomic_load_n(&table[1], __ATOMIC_ACQUIRE) == 0) {
+        for (i = 255; i >= 0; i--) {
+            for (c = i, j = 0; j < 8; j++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            if (i == 1) __atomic_store_n(&table[i], c, __ATOMIC_RELEASE);
+            else table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    while (len-- > 0) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/**
+ * Función: fnv1a64
+ * ----------------
+ * Hash FNV-1a de 64 bits de una cadena, para índices en memoria.
+ */
+uint64_t fnv1a64(const char *string) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*string) {
+        h ^= (unsigned char)*string++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
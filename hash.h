@@ -0,0 +1,23 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t bits;
+    uint8_t block[64];
+    size_t len;
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t out[SHA256_SIZE]);
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+uint64_t fnv1a64(const char *string);
+
+#endif
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+
+#include "iopolicy.h"
+
+#define IO_WINDOW_MIN (128 * 1024)
+#define IO_WINDOW_MAX (8 * 1024 * 1024)
+#define IO_DROP_CHUNK (4 * 1024 * 1024) // granularidad del descarte y de la escritura a disco
+
+// Tamaño a partir del cual una transferencia no se conserva en la caché
+off_t io_bulk_threshold = 64 * 1024 * 1024;
+
+/**
+ * Función: io_policy_start
+ * ------------------------
+ * Prepara la política para transferir size bytes de fd desde start.
+ *
+ * writing: true para un STOR, false para un RETR
+ */
+void io_policy_start(struct io_policy *policy, int fd, off_t start, off_t size, bool writing) {
+    policy->fd = fd;
+    policy->writing = writing;
+    policy->bulk = size >= io_bulk_threshold;
+    policy->start = policy->next = policy->ahead = policy->dropped = start;
+    policy->end = start + size;
+    policy->window = IO_WINDOW_MIN;
+
+    // Duplica la lectura anticipada del kernel para este archivo
+    if (!writing && size > IO_WINDOW_MIN) posix_fadvise(fd, start, size, POSIX_FADV_SEQUENTIAL);
+}
+
+static void drop(struct io_policy *policy, off_t upto) {
+    posix_fadvise(policy->fd, policy->dropped, upto - policy->dropped, POSIX_FADV_DONTNEED);
+    policy->dropped = upto;
+}
+
+/**
+ * Función: io_policy_read
+ * -----------------------
+ * Se llama antes de leer o enviar [offset, offset + len). Mientras el
+ * acceso sea secuencial pide la próxima ventana cuando se consumió la mitad
+ * de la anterior y la duplica hasta IO_WINDOW_MAX; un salto la reinicia.
+ * En archivos grandes descarta lo enviado con un bloque de margen, porque
+ * las últimas páginas pueden seguir en el buffer del socket.
+ */
+void io_policy_read(struct io_policy *policy, off_t offset, size_t len) {
+    off_t end = offset + len, from, to;
+
+    if (offset != policy->next) {
+        policy->window = IO_WINDOW_MIN;
+        policy->ahead = offset;
+    }
+    policy->next = end;
+
+    if (end + policy->window / 2 > policy->ahead && policy->ahead < policy->end) {
+        from = policy->ahead > offset ? policy->ahead : offset;
+        to = end + policy->window < policy->end ? end + policy->window : policy->end;
+        posix_fadvise(policy->fd, from, to - from, POSIX_FADV_WILLNEED);
+        policy->ahead = to;
+        if (policy->window < IO_WINDOW_MAX) policy->window *= 2;
+    }
+
+    if (policy->bulk && offset - IO_DROP_CHUNK - policy->dropped >= IO_DROP_CHUNK)
+        drop(policy, offset - IO_DROP_CHUNK);
+}
+
+/**
+ * Función: io_policy_written
+ * --------------------------
+ * Se llama después de escribir [offset, offset + len). En archivos grandes
+ * inicia la escritura a disco de cada bloque completo y descarta el bloque
+ * anterior, que para entonces ya suele estar escrito; así la caché no se
+ * llena de páginas sucias del STOR.
+ */
+void io_policy_written(struct io_policy *policy, off_t offset, size_t len) {
+    off_t end = offset + len;
+
+    policy->next = end;
+    if (!policy->bulk || end - policy->ahead < IO_DROP_CHUNK) return;
+
+    sync_file_range(policy->fd, policy->ahead, end - policy->ahead, SYNC_FILE_RANGE_WRITE);
+    if (policy->ahead > policy->dropped) {
+        sync_file_range(policy->fd, policy->dropped, policy->ahead - policy->dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        drop(policy, policy->ahead);
+    }
+    policy->ahead = end;
+}
+
+/**
+ * Función: io_policy_finish
+ * -------------------------
+ * Termina la transferencia: en archivos grandes descarta lo que quedó. En
+ * un STOR sólo se descartan las páginas ya escritas; el resto se escribe a
+ * disco en segundo plano sin demorar la respuesta.
+ */
+void io_policy_finish(struct io_policy *policy) {
+    if (!policy->bulk || policy->next <= policy->dropped) return;
+    if (policy->writing)
+        sync_file_range(policy->fd, policy->ahead, policy->next - policy->ahead, SYNC_FILE_RANGE_WRITE);
+    drop(policy, policy->next);
+}
@@ -0,0 +1,34 @@
+#ifndef IOPOLICY_H
+#define IOPOLICY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Política de caché de páginas para una transferencia. Las lecturas
+ * secuenciales piden lectura anticipada con una ventana que crece mientras
+ * el acceso siga siendo secuencial; en los archivos que superan el umbral,
+ * lo ya enviado o escrito se descarta de la caché para no desplazar a los
+ * archivos pequeños y frecuentes.
+ */
+struct io_policy {
+    int fd;
+    bool writing;
+    bool bulk;              // supera el umbral: se descarta lo transferido
+    off_t start, end;       // rango del archivo que abarca la transferencia
+    off_t next;             // próximo offset esperado si el acceso es secuencial
+    off_t window;           // ventana actual de lectura anticipada
+    off_t ahead;            // límite de la lectura anticipada pedida, o de la
+                            // escritura a disco iniciada en un STOR
+    off_t dropped;          // hasta dónde se descartó
+};
+
+extern off_t io_bulk_threshold;
+
+void io_policy_start(struct io_policy *policy, int fd, off_t start, off_t size, bool writing);
+void io_policy_read(struct io_policy *policy, off_t offset, size_t len);
+void io_policy_written(struct io_policy *policy, off_t offset, size_t len);
+void io_policy_finish(struct io_policy *policy);
+
+#endif
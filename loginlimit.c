@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+
+#include "loginlimit.h"
+
+#define LIMIT_ENTRIES 8192      // claves seguidas a la vez (potencia de 2)
+#define LIMIT_PROBES 32         // entradas revisadas por búsqueda
+#define LIMIT_GROUPS 65536      // grupos de claves con su fin de bloqueo
+#define LIMIT_BACKOFF_BASE 2    // segundos del primer bloqueo
+#define LIMIT_BACKOFF_MAX 900   // tope del bloqueo; sin reincidir en este lapso se olvida
+
+/**
+ * Entrada de una IP o un usuario. Cada campo se actualiza entero con CAS:
+ *
+ *   window: número de ventana (32 bits), fallos en la ventana actual (16)
+ *           y en la anterior (16)
+ *   block:  fin del bloqueo en segundos de CLOCK_MONOTONIC (32 bits) y
+ *           cantidad de bloqueos seguidos (16)
+ */
+struct limit_entry {
+    uint64_t key;               // hash de la clave, 0 si la entrada está libre
+    uint64_t window;
+    uint64_t block;
+};
+
+/**
+ * Tabla compartida. Cada grupo de claves guarda el fin del bloqueo más
+ * tardío de sus claves: las conexiones de claves sin bloqueos vigentes en
+ * su grupo se resuelven leyendo un valor, sin buscar en la tabla. Los
+ * bloqueos vencen solos, sin que haya que apagar nada.
+ *
+ * Los fallos de una clave que no encuentra lugar en su sondeo (la tabla
+ * llena de claves descartables) se cuentan en la entrada de desborde de su
+ * tipo. Mientras ésta está bloqueada se rechaza a toda clave sin lugar: el
+ * límite no se puede esquivar llenando la tabla.
+ */
+enum { KIND_IP, KIND_USER };
+
+struct limit_table {
+    uint32_t group_until[LIMIT_GROUPS];
+    struct limit_entry overflow[2];
+    struct limit_entry entries[LIMIT_ENTRIES];
+};
+
+struct login_limits login_limits = { 20, 5, 60 };
+
+static struct limit_table *table;
+static uint64_t seed;           // clave aleatoria del hash, elegida en loginlimit_init
+
+static uint32_t now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Función: key_hash
+ * -----------------
+ * FNV-1a de 64 bits partiendo de la clave aleatoria y mezclado al final
+ * con ella, para que no se puedan calcular de antemano nombres que caigan
+ * en el mismo sondeo. El tipo separa una IP de un usuario con los mismos
+ * bytes.
+ */
+static uint64_t key_hash(char kind, const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    size_t i;
+
+    h = (h ^ (unsigned char) kind) * 0x100000001b3ULL;
+    for (i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+
+    // Finalizador de splitmix64
+    h ^= seed;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h != 0 ? h : 1;
+}
+
+static unsigned key_group(uint64_t key) {
+    return (key >> 32) % LIMIT_GROUPS;
+}
+
+static uint32_t block_end(const struct limit_entry *entry) {
+    return (uint32_t) __atomic_load_n(&entry->block, __ATOMIC_SEQ_CST);
+}
+
+// Una entrada sin fallos en las dos últimas ventanas ni bloqueos recientes
+// se puede reusar para otra clave
+static bool idle(const struct limit_entry *entry, uint32_t now) {
+    uint32_t window = (uint32_t) __atomic_load_n(&entry->window, __ATOMIC_RELAXED);
+
+    return window + 1 < now / login_limits.window && block_end(entry) + LIMIT_BACKOFF_MAX < now;
+}
+
+/**
+ * Función: find
+ * -------------
+ * Busca la entrada de una clave con sondeo lineal. Las claves se insertan
+ * con CAS sobre una entrada libre y nunca se borran: una entrada inactiva
+ * se reusa en su lugar, así las cadenas de sondeo no se cortan.
+ *
+ * create: insertar la clave si no está
+ *
+ * return: la entrada, NULL si no está (o la tabla está llena)
+ */
+static struct limit_entry *find(uint64_t key, bool create, uint32_t now) {
+    struct limit_entry *entry, *stale = NULL;
+    uint64_t current;
+    unsigned i;
+
+    for (i = 0; i < LIMIT_PROBES; i++) {
+        entry = &table->entries[(key + i) & (LIMIT_ENTRIES - 1)];
+        current = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+        if (current == key) return entry;
+        if (current == 0) {
+            if (!create) return NULL;
+            if (__atomic_compare_exchange_n(&entry->key, &current, key, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || current == key)
+                return entry;
+        } else if (create && stale == NULL && idle(entry, now)) {
+            stale = entry;
+        }
+    }
+    if (stale == NULL) return NULL;
+
+    // Reusar la entrada inactiva; un fallo contado en el medio se puede perder
+    current = __atomic_load_n(&stale->key, __ATOMIC_ACQUIRE);
+    if (!__atomic_compare_exchange_n(&stale->key, &current, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return current == key ? stale : NULL;
+    __atomic_store_n(&stale->window, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stale->block, 0, __ATOMIC_SEQ_CST);
+    return stale;
+}
+
+/**
+ * Función: room
+ * -------------
+ * Indica si el sondeo de la clave tiene una entrada libre o inactiva, es
+ * decir, si un fallo de la clave se contaría en su propia entrada.
+ */
+static bool room(uint64_t key, uint32_t now) {
+    struct limit_entry *entry;
+    unsigned i;
+
+    for (i = 0; i < LIMIT_PROBES; i++) {
+        entry = &table->entries[(key + i) & (LIMIT_ENTRIES - 1)];
+        if (__atomic_load_n(&entry->key, __ATOMIC_ACQUIRE) == 0 || idle(entry, now)) return true;
+    }
+    return false;
+}
+
+/**
+ * Función: count_failure
+ * ----------------------
+ * Suma un fallo y estima los de la ventana deslizante: los de la ventana
+ * actual más los de la anterior en la proporción que todavía cubre.
+ *
+ * return: fallos estimados en los últimos login_limits.window segundos
+ */
+static unsigned count_failure(struct limit_entry *entry, uint32_t now) {
+    uint64_t old = __atomic_load_n(&entry->window, __ATOMIC_RELAXED), new;
+    uint32_t window = now / login_limits.window, last;
+    unsigned current, previous;
+
+    do {
+        last = (uint32_t) old;
+        current = (old >> 32) & 0xffff;
+        previous = old >> 48;
+        if (last != window) {
+            previous = last + 1 == window ? current : 0;
+            current = 0;
+        }
+        if (current < 0xffff) current++;
+        new = window | (uint64_t) current << 32 | (uint64_t) previous << 48;
+    } while (!__atomic_compare_exchange_n(&entry->window, &old, new, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return current + previous * (login_limits.window - now % login_limits.window) / login_limits.window;
+}
+
+/**
+ * Función: block
+ * --------------
+ * Bloquea la clave por LIMIT_BACKOFF_BASE segundos, el doble en cada
+ * bloqueo seguido, hasta LIMIT_BACKOFF_MAX, y extiende el fin de bloqueo
+ * de su grupo.
+ *
+ * key: clave de la entrada; 0 para una entrada de desborde, que no tiene
+ * grupo
+ *
+ * return: segundos de bloqueo, 0 si la clave ya estaba bloqueada
+ */
+static unsigned block(struct limit_entry *entry, uint64_t key, uint32_t now) {
+    uint64_t old = __atomic_load_n(&entry->block, __ATOMIC_SEQ_CST), new;
+    unsigned strikes, seconds;
+    uint32_t until, *group;
+
+    do {
+        until = (uint32_t) old;
+        strikes = (old >> 32) & 0xffff;
+        if (until > now) return 0;
+        if (now - until > LIMIT_BACKOFF_MAX) strikes = 0;
+        if (strikes < 0xffff) strikes++;
+        seconds = strikes > 10 ? LIMIT_BACKOFF_MAX : LIMIT_BACKOFF_BASE << (strikes - 1);
+        if (seconds > LIMIT_BACKOFF_MAX) seconds = LIMIT_BACKOFF_MAX;
+        new = (uint32_t) (now + seconds) | (uint64_t) strikes << 32;
+    } while (!__atomic_compare_exchange_n(&entry->block, &old, new, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+    if (key != 0) {
+        group = &table->group_until[key_group(key)];
+        until = __atomic_load_n(group, __ATOMIC_SEQ_CST);
+        while (until < now + seconds &&
+               !__atomic_compare_exchange_n(group, &until, now + seconds, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    }
+    return seconds;
+}
+
+/**
+ * Función: blocked
+ * ----------------
+ * Sin bloqueos vigentes en el grupo de la clave ni en el desborde de su
+ * tipo cuesta dos lecturas. Si no, busca la entrada de la clave: a lo sumo
+ * LIMIT_PROBES, nunca la tabla entera. Una clave sin entrada queda
+ * bloqueada si el desborde lo está y tampoco tiene lugar en su sondeo.
+ */
+static bool blocked(uint64_t key, int kind) {
+    struct limit_entry *overflow = &table->overflow[kind], *entry;
+    uint32_t now = now_s();
+
+    if (__atomic_load_n(&table->group_until[key_group(key)], __ATOMIC_SEQ_CST) <= now &&
+        block_end(overflow) <= now)
+        return false;
+
+    if ((entry = find(key, false, now)) != NULL) return block_end(entry) > now;
+    return block_end(overflow) > now && !room(key, now);
+}
+
+static void failed(uint64_t key, int kind, unsigned limit, const char *what, const char *name) {
+    struct limit_entry *entry;
+    uint32_t now = now_s();
+    unsigned seconds;
+
+    if ((entry = find(key, true, now)) == NULL) {
+        // Sin lugar para la clave: el fallo cuenta en el desborde del tipo
+        entry = &table->overflow[kind];
+        if (count_failure(entry, now) > limit && (seconds = block(entry, 0, now)) > 0)
+            warnx("Login limit table full, failed logins of unlisted %s blocked for %u s",
+                  kind == KIND_IP ? "addresses" : "users", seconds);
+        return;
+    }
+    if (count_failure(entry, now) > limit && (seconds = block(entry, key, now)) > 0)
+        warnx("Too many failed logins %s %s, blocked for %u s", what, name, seconds);
+}
+
+/**
+ * Función: login_limits_parse
+ * ---------------------------
+ * Lee los límites con la forma "ip_failures:user_failures[:window]". Un
+ * máximo de 0 desactiva ese límite.
+ *
+ * return: false si la especificación es inválida
+ */
+bool login_limits_parse(const char *spec) {
+    unsigned ip, user, window = login_limits.window;
+    int n;
+
+    n = sscanf(spec, "%u:%u:%u", &ip, &user, &window);
+    if (n < 2 || window == 0) return false;
+    login_limits.ip_failures = ip;
+    login_limits.user_failures = user;
+    login_limits.window = window;
+    return true;
+}
+
+/**
+ * Función: loginlimit_init
+ * ------------------------
+ * Crea la tabla en memoria compartida y elige la clave del hash; debe
+ * llamarse antes de crear a los hijos. Con ambos límites en 0 no se crea y
+ * no se limita nada.
+ *
+ * return: false si no se pudo reservar la tabla
+ */
+bool loginlimit_init(void) {
+    if (login_limits.ip_failures == 0 && login_limits.user_failures == 0) return true;
+
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        warn("Error seeding login limit table");
+        return false;
+    }
+    table = mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        warn("Error creating login limit table");
+        table = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Función: loginlimit_ip_blocked
+ * ------------------------------
+ * Indica si la dirección está bloqueada. Sin bloqueos vigentes en su grupo
+ * cuesta dos lecturas, así que se puede consultar antes del fork.
+ */
+bool loginlimit_ip_blocked(struct in_addr ip) {
+    return table != NULL && login_limits.ip_failures > 0 && blocked(key_hash('i', &ip, sizeof(ip)), KIND_IP);
+}
+
+/**
+ * Función: loginlimit_user_blocked
+ * --------------------------------
+ * Indica si el usuario está bloqueado, para rechazar el intento sin leer
+ * el archivo de credenciales.
+ */
+bool loginlimit_user_blocked(const char *user) {
+    return table != NULL && login_limits.user_failures > 0 && blocked(key_hash('u', user, strlen(user)), KIND_USER);
+}
+
+/**
+ * Función: loginlimit_failed
+ * --------------------------
+ * Registra un login fallido de la dirección y el usuario, y bloquea al que
+ * supere su máximo en la ventana.
+ */
+void loginlimit_failed(struct in_addr ip, const char *user) {
+    if (table == NULL) return;
+    if (login_limits.ip_failures > 0)
+        failed(key_hash('i', &ip, sizeof(ip)), KIND_IP, login_limits.ip_failures, "from", inet_ntoa(ip));
+    if (login_limits.user_failures > 0)
+        failed(key_hash('u', user, strlen(user)), KIND_USER, login_limits.user_failures, "for user", user);
+}
+
+/**
+ * Función: loginlimit_succeeded
+ * -----------------------------
+ * Un login correcto olvida los fallos del usuario, para que unos errores
+ * de tipeo no se sumen a los siguientes. Los de la dirección se mantienen:
+ * detrás de una IP puede haber clientes con y sin credenciales válidas.
+ */
+void loginlimit_succeeded(const char *user) {
+    struct limit_entry *entry;
+
+    if (table == NULL || login_limits.user_failures == 0) return;
+    if ((entry = find(key_hash('u', user, strlen(user)), false, 0)) == NULL) return;
+    __atomic_store_n(&entry->window, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->block, 0, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,30 @@
+#ifndef LOGINLIMIT_H
+#define LOGINLIMIT_H
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+/**
+ * Límite de intentos de login fallidos, compartido entre el proceso
+ * principal y los hijos. Se cuentan los fallos de cada dirección IP y de
+ * cada usuario en una ventana deslizante. Al superar el máximo, la clave
+ * queda bloqueada por un tiempo que se duplica en cada reincidencia. Las
+ * actualizaciones no toman locks: un hijo que muere a mitad no deja nada
+ * tomado.
+ */
+struct login_limits {
+    unsigned ip_failures;       // fallos por IP en la ventana; 0 desactiva el límite
+    unsigned user_failures;     // fallos por usuario en la ventana
+    unsigned window;            // segundos de la ventana
+};
+
+extern struct login_limits login_limits;
+
+bool login_limits_parse(const char *spec);
+bool loginlimit_init(void);
+bool loginlimit_ip_blocked(struct in_addr ip);
+bool loginlimit_user_blocked(const char *user);
+void loginlimit_failed(struct in_addr ip, const char *user);
+void loginlimit_succeeded(const char *user);
+
+#endif
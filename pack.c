@@ -0,0 +1,98 @@
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "pack.h"
+
+// Archivo empaquetado abierto: un único descriptor para todos los RETR y el
+// índice mapeado en memoria, compartido por los hijos tras el fork
+static int pack_fd = -1;
+static const struct pack_header *header;
+static const struct pack_slot *slots;
+static const char *names;
+
+/**
+ * Función: pack_open
+ * ------------------
+ * Abre el archivo empaquetado y mapea su índice y sus nombres. Los datos
+ * no se mapean: se envían con sendfile() desde el descriptor.
+ *
+ * path: ruta del archivo creado con ftppack
+ *
+ * return: true si el archivo es válido
+ */
+bool pack_open(const char *path) {
+    struct pack_header probe;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0 ||
+        pread(fd, &probe, sizeof(probe), 0) != sizeof(probe)) {
+        warn("Error opening pack %s", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    if (memcmp(probe.magic, PACK_MAGIC, sizeof(probe.magic)) != 0 ||
+        (probe.slots & (probe.slots - 1)) != 0 || probe.data_offset > (uint64_t) st.st_size ||
+        probe.names_offset != sizeof(probe) + (uint64_t) probe.slots * sizeof(struct pack_slot) ||
+        probe.data_offset < probe.names_offset) {
+        warnx("Invalid pack %s", path);
+        close(fd);
+        return false;
+    }
+
+    map = mmap(NULL, probe.data_offset, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        warn("Error mapping pack index");
+        close(fd);
+        return false;
+    }
+    madvise(map, probe.data_offset, MADV_WILLNEED);
+
+    pack_fd = fd;
+    header = map;
+    slots = (const struct pack_slot *) (header + 1);
+    names = (const char *) map + header->names_offset;
+    return true;
+}
+
+/**
+ * Función: pack_lookup
+ * --------------------
+ * Busca la ruta en el índice: un hash y, normalmente, una sola casilla.
+ *
+ * path: ruta pedida por el cliente
+ * fd: descriptor del archivo empaquetado
+ * offset, size: rango del contenido dentro del archivo
+ *
+ * return: false si no hay archivo empaquetado o la ruta no está
+ */
+bool pack_lookup(const char *path, int *fd, uint64_t *offset, uint64_t *size) {
+    uint64_t key, mask, i, probes;
+    size_t len;
+
+    if (header == NULL || header->slots == 0) return false;
+
+    while (path[0] == '.' && path[1] == '/') path += 2;
+    len = strlen(path);
+    key = fnv1a64(path) | 1;
+    mask = header->slots - 1;
+
+    for (i = key & mask, probes = 0; probes < header->slots && slots[i].key != 0;
+         i = (i + 1) & mask, probes++) {
+        if (slots[i].key == key && slots[i].name_len == len &&
+            slots[i].name_offset + len <= header->data_offset - header->names_offset &&
+            memcmp(names + slots[i].name_offset, path, len) == 0) {
+            *fd = pack_fd;
+            *offset = slots[i].offset;
+            *size = slots[i].size;
+            return true;
+        }
+    }
+    return false;
+}
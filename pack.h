@@ -0,0 +1,37 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PACK_MAGIC "FTPPACK1"
+
+/**
+ * Formato del archivo empaquetado (todos los enteros en el orden del host):
+ *
+ *   pack_header | pack_slot[slots] | nombres | datos
+ *
+ * El índice es una tabla hash de direccionamiento abierto con sondeo
+ * lineal y slots potencia de dos; key = fnv1a64(ruta) | 1, 0 indica casilla
+ * libre. Los nombres se guardan para descartar colisiones del hash.
+ */
+struct pack_header {
+    char magic[8];
+    uint32_t slots;
+    uint32_t count;
+    uint64_t names_offset;
+    uint64_t data_offset;
+};
+
+struct pack_slot {
+    uint64_t key;
+    uint64_t offset;        // posición absoluta del contenido en el archivo
+    uint64_t size;
+    uint32_t name_offset;   // relativo a names_offset
+    uint32_t name_len;
+};
+
+bool pack_open(const char *path);
+bool pack_lookup(const char *path, int *fd, uint64_t *offset, uint64_t *size);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,15 +7,40 @@
 #include <unistd.h>
 #include <err.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <ctype.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <limits.h>
+
+#include "arena.h"
+#include "autotune.h"
+#include "loginlimit.h"
+#include "writebehind.h"
+#include "digest.h"
+#include "fdpass.h"
+#include "handoff.h"
+#include "iopolicy.h"
+#include "pack.h"
+#include "tarstream.h"
+#include "timerwheel.h"
+#include "trace.h"
 
 #define _POSIX_C_SOURCE 200809L
 
-#define BUFSIZE 512 // tamaño máximo para recibir los datos del cliente
-#define CMDSIZE 4
+#define BUFSIZE 512 // tamaño máximo de los mensajes del canal de control
+#define SESSION_ARENA_SIZE (8 * 1024) // memoria fija de cada sesión, sin los buffers de datos
+#define SEND_CHUNK (1024 * 1024) // copia local entre consultas a la política de E/S
+#define CMDSIZE 8
 #define PARSIZE 100
 
 #define MSG_220 "220 srvFtp version 1.0\r\n"
@@ -24,10 +50,177 @@
 #define MSG_221 "221 Goodbye\r\n"
 #define MSG_550 "550 %s: no such file or directory\r\n"
 #define MSG_299 "299 File %s size %ld bytes\r\n"
+#define MSG_299_AT "299 File %s size %ld bytes at %llu\r\n"
 #define MSG_226 "226 Transfer complete\r\n"
 #define MSG_150 "150 Opening BINARY mode data connection for %s (%ld bytes)\r\n"
+#define MSG_150_TAR "150 Opening BINARY mode data connection for %s (%s stream)\r\n"
 #define MSG_200 "200 PORT command successful\r\n"
+#define MSG_421_BUSY "421 Too many connections, try again later\r\n"
+#define MSG_421_USER "421 Too many sessions for user %s\r\n"
+#define MSG_421_LOGIN "421 Login timeout, closing control connection\r\n"
+#define MSG_421_IDLE "421 Idle timeout, closing control connection\r\n"
+#define MSG_421_BLOCKED "421 Too many failed logins, try again later\r\n"
+#define MSG_425 "425 Can't open data connection\r\n"
+#define MSG_426 "426 Connection closed; transfer aborted\r\n"
+#define MSG_501 "501 Argument too long\r\n"
+#define MSG_213_HASH "213 SHA-256 %s %s\r\n"
+#define MSG_250_CRC "250 %08X\r\n"
+#define MSG_250_SHA "250 %s\r\n"
 
+/**
+ * Límites del servidor: tiempos de espera en segundos y cantidad máxima de
+ * sesiones simultáneas en total, por dirección IP y por usuario.
+ */
+struct limits {
+    unsigned login_timeout, idle_timeout, data_timeout, stall_timeout;
+    int max_sessions, max_per_ip, max_per_user;
+};
+
+static struct limits limits = { 30, 300, 30, 60, 256, 16, 8 };
+
+// Índice de hashes: archivo auxiliar (NULL sin índice) e hilos de cálculo
+static char *digest_index;
+static int digest_threads = 2;
+
+/**
+ * Tabla de sesiones compartida entre el proceso principal y sus hijos.
+ * El principal reserva la entrada antes del fork y la libera al recoger al
+ * hijo; el hijo completa el usuario una vez autenticado.
+ */
+struct session_slot {
+    pid_t pid;
+    struct in_addr ip;
+    char user[PARSIZE];
+    unsigned wb_buffers;    // buffers de escritura diferida cargados por el hijo
+};
+
+struct session_table {
+    pthread_mutex_t lock;   // protege la asignación de usuarios entre hijos
+    unsigned wb_buffers;    // buffers de escritura diferida de todos los hijos
+    int size;
+    struct session_slot slots[];
+};
+
+static struct session_table *sessions;
+static int own_slot = -1;   // entrada de la sesión atendida por este proceso
+
+// Actualización sin cortes (-U): por este socket Unix el servidor nuevo
+// recibe el socket de escucha y las sesiones inactivas del viejo
+static char *handoff_path;
+static char **saved_argv;
+static int master_sd = -1, handoff_sd = -1;
+static volatile sig_atomic_t upgrade_requested;
+static bool idle_wait;      // el hijo espera un comando: la sesión se puede pasar
+static sigset_t wait_mask;  // máscara durante las esperas: SIGUSR2 sólo llega en ellas
+
+// Sesiones locales (-l): por el socket Unix de control viajan descriptores
+// abiertos en lugar de datos; no hay canal de datos ni copias
+static char *local_path;
+static int local_sd = -1;
+static bool local_session;  // la sesión de este hijo llegó por el socket Unix
+static int received_fd = -1; // descriptor adjunto al último comando, -1 si ninguno
+
+// Cada hijo atiende una única sesión: una rueda con dos temporizadores, uno
+// para el canal de control (login/inactividad) y otro para el de datos
+static struct timer_wheel wheel;
+static struct tw_timer ctl_timer, data_timer;
+static char *expired; // respuesta del temporizador vencido, NULL si ninguno
+
+// Toda la memoria dinámica de la sesión sale de su arena; los buffers de
+// un STOR, de la escritura diferida (writebehind.c)
+static struct arena session_arena;
+
+// Ajuste de la transferencia en curso y archivo de métricas (-M), -1 sin él
+static struct autotune tune;
+static int metrics_fd = -1;
+
+// Trazas (-t): se traza una de cada trace_every sesiones y se vuelca en
+// trace_dir al terminar la sesión o al recibir SIGUSR1
+static char *trace_dir;
+static int trace_every = 100;
+static volatile sig_atomic_t trace_requested;
+
+static void timeout_cb(void *arg) {
+    expired = arg;
+}
+
+/**
+ * Función: trace_save
+ * -------------------
+ * Vuelca las trazas de la sesión en trace_dir/trace-<pid>.json. Cada
+ * volcado reemplaza al anterior con todo lo que quedó en los anillos.
+ */
+static void trace_save(void) {
+    char path[PATH_MAX];
+
+    trace_requested = 0;
+    if (!trace_enabled) return;
+    snprintf(path, sizeof(path), "%s/trace-%d.json", trace_dir, (int) getpid());
+    if (!trace_write(path)) warn("Cannot write trace %s", path);
+}
+
+/**
+ * Función: wait_fd
+ * ----------------
+ * Espera a que el descriptor esté listo para los eventos pedidos, avanzando
+ * la rueda de temporizadores mientras tanto.
+ *
+ * fd: descriptor a esperar
+ * events: eventos de poll() (POLLIN, POLLOUT)
+ *
+ * return: true si el descriptor está listo, false si venció un temporizador,
+ * hubo un error o, esperando un comando, se pidió una actualización
+ */
+static bool wait_fd(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    struct timespec ts;
+    int ready, timeout;
+
+    while (expired == NULL && !(idle_wait && upgrade_requested)) {
+        if (trace_requested) trace_save();
+        timeout = tw_next_timeout(&wheel);
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        ready = ppoll(&pfd, 1, timeout < 0 ? NULL : &ts, &wait_mask);
+        if (ready < 0 && errno != EINTR) {
+            warn("Error waiting on socket");
+            return false;
+        }
+        tw_advance(&wheel);
+        if (ready > 0) return true;
+    }
+    return false;
+}
+
+
+/**
+ * Función: send_ans
+ * -----------------
+ * Envía una respuesta al cliente a través del descriptor de socket especificado.
+ * 
+ * sd: descriptor de socket para enviar la respuesta
+ * message: cadena de caracteres de la respuesta formateada
+ * ...: argumentos variables para formatear la cadena de caracteres
+ * 
+ * return: true si se envió correctamente la respuesta, false en caso contrario
+ */
+bool send_ans(int sd, char *message, ...) {
+    char buffer[BUFSIZE];
+
+    va_list args;
+    va_start(args, message);
+
+    vsprintf(buffer, message, args);
+    va_end(args);
+
+    // Enviar la respuesta preformateada y verificar errores
+    if (write(sd, buffer, strlen(buffer)) < 0) {
+        warn("Error sending message");
+        return false;
+    }
+
+    return true;
+}
 
 /**
  * Función: recv_cmd
@@ -37,16 +230,23 @@
  * 
  * sd: descriptor de socket para recibir el comando
  * operation: cadena de caracteres donde se almacenará el comando recibido
- * param: cadena de caracteres donde se almacenarán los parámetros del comando (si los hay)
+ * param: cadena de caracteres donde se almacenarán los parámetros del comando (si los hay),
+ * de PARSIZE bytes; un parámetro más largo se rechaza con 501
  * 
  * return: true si se recibió y procesó correctamente el comando, false en caso contrario
  */
 bool recv_cmd(int sd, char *operation, char *param) {
     char buffer[BUFSIZE], *token;
-    int recv_s;
+    ssize_t recv_s;
+    bool expected = operation[0] != '\0';
 
-    // Recibir el comando en el buffer y manejar errores
-    if ((recv_s = read(sd, buffer, BUFSIZE)) < 0) {
+    // Esperar el comando sin superar el tiempo de login o inactividad
+    if (!wait_fd(sd, POLLIN)) return false;
+
+    // Recibir el comando en el buffer y manejar errores; en una sesión local
+    // el comando puede traer un descriptor adjunto
+    if (received_fd >= 0) close(received_fd);
+    if ((recv_s = fd_recv(sd, buffer, BUFSIZE - 1, &received_fd)) < 0) {
         warnx("Error reading buffer"); // send _ans ???
         return false;
     }
@@ -54,13 +254,14 @@ bool recv_cmd(int sd, char *operation, char *param) {
         warnx("Empty buffer");
         return false;
     }
+    buffer[recv_s] = '\0';
 
     // Eliminar los caracteres de terminación del buffer
     buffer[strcspn(buffer, "\r\n")] = 0;
 
     // Analizar el buffer para extraer el comando y los parámetros
     token = strtok(buffer, " ");
-    if (token == NULL || strlen(token) < 4) {
+    if (token == NULL || strlen(token) < 4 || strlen(token) >= CMDSIZE) {
         warn("not valid ftp command");
         return false;
     } else {
@@ -70,86 +271,434 @@ bool recv_cmd(int sd, char *operation, char *param) {
             return false;
         }
         token = strtok(NULL, " ");
+        if (token != NULL && strlen(token) >= PARSIZE) {
+            // Un argumento que no entra se rechaza sin copiarlo: durante el
+            // login termina la autenticación, después sólo ese comando
+            warnx("argument too long for %s", operation);
+            send_ans(sd, MSG_501);
+            if (expected) return false;
+            operation[0] = '\0';
+            return true;
+        }
         if (token != NULL) strcpy(param, token);
     }
     return true;
 }
 
+
 /**
- * Función: send_ans
- * -----------------
- * Envía una respuesta al cliente a través del descriptor de socket especificado.
- * 
- * sd: descriptor de socket para enviar la respuesta
- * message: cadena de caracteres de la respuesta formateada
- * ...: argumentos variables para formatear la cadena de caracteres
- * 
- * return: true si se envió correctamente la respuesta, false en caso contrario
+ * Función: send_ans_fd
+ * --------------------
+ * Como send_ans, pero adjunta un descriptor a la respuesta. Sólo sirve en
+ * sesiones locales.
+ *
+ * fd: descriptor a pasar al cliente
  */
-bool send_ans(int sd, char *message, ...) {
+static bool send_ans_fd(int sd, int fd, char *message, ...) {
     char buffer[BUFSIZE];
-
     va_list args;
-    va_start(args, message);
+    int len;
 
-    vsprintf(buffer, message, args);
+    va_start(args, message);
+    len = vsnprintf(buffer, sizeof(buffer), message, args);
     va_end(args);
 
-    // Enviar la respuesta preformateada y verificar errores
-    if (write(sd, buffer, strlen(buffer)) < 0) {
+    if (fd_send(sd, buffer, len, fd) != len) {
         warn("Error sending message");
         return false;
     }
+    return true;
+}
 
+/**
+ * Función: data_connect
+ * ---------------------
+ * Abre la conexión de datos hacia la dirección indicada por PORT. El socket
+ * queda en modo no bloqueante para que las esperas pasen por la rueda de
+ * temporizadores.
+ *
+ * addr: dirección de datos del cliente
+ *
+ * return: descriptor del canal de datos, -1 si no se pudo conectar a tiempo
+ */
+static int data_connect(struct sockaddr_in addr) {
+    int dsd, error = 0;
+    socklen_t len = sizeof(error);
+    uint64_t start = TRACE_BEGIN();
+
+    if ((dsd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        warn("Cannot create data socket");
+        return -1;
+    }
+    fcntl(dsd, F_SETFL, fcntl(dsd, F_GETFL) | O_NONBLOCK);
+
+    tw_add(&wheel, &data_timer, limits.data_timeout * 1000UL);
+    if (connect(dsd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        if (errno != EINPROGRESS || !wait_fd(dsd, POLLOUT) ||
+            getsockopt(dsd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            warnx("Error on connect to data channel");
+            tw_del(&wheel, &data_timer);
+            expired = NULL;
+            close(dsd);
+            return -1;
+        }
+    }
+
+    // A partir de aquí el temporizador vigila que la transferencia avance
+    tw_add(&wheel, &data_timer, limits.stall_timeout * 1000UL);
+    TRACE_END("data_connect", start, 0);
+    return dsd;
+}
+
+/**
+ * Función: data_write
+ * -------------------
+ * Escribe el buffer completo en el canal de datos. Cada avance rearma el
+ * temporizador de transferencia estancada.
+ *
+ * return: true si se escribió todo, false si hubo error o se venció el plazo
+ */
+static bool data_write(int dsd, const char *buffer, size_t len) {
+    uint64_t start = TRACE_BEGIN();
+    size_t total = len;
+    ssize_t sent;
+
+    while (len > 0) {
+        if ((sent = write(dsd, buffer, len)) < 0) {
+            if (errno != EAGAIN && errno != EINTR) return false;
+            if (!wait_fd(dsd, POLLOUT)) return false;
+            continue;
+        }
+        buffer += sent;
+        len -= sent;
+        autotune_update(&tune, sent);
+        tw_add(&wheel, &data_timer, limits.stall_timeout * 1000UL);
+    }
+    TRACE_END("data_write", start, total);
     return true;
 }
 
+/**
+ * Función: data_sendfile
+ * ----------------------
+ * Envía len bytes del archivo desde offset por el canal de datos sin
+ * copiarlos a espacio de usuario.
+ *
+ * return: true si se envió todo, false si hubo error, el archivo se acortó
+ * o se venció el plazo
+ */
+static bool data_sendfile(int dsd, int fd, off_t offset, size_t len) {
+    ssize_t sent;
+
+    while (len > 0) {
+        if ((sent = sendfile(dsd, fd, &offset, len)) < 0) {
+            if (errno != EAGAIN && errno != EINTR) return false;
+            if (!wait_fd(dsd, POLLOUT)) return false;
+            continue;
+        }
+        if (sent == 0) return false;
+        len -= sent;
+        tw_add(&wheel, &data_timer, limits.stall_timeout * 1000UL);
+    }
+    return true;
+}
+
+/**
+ * Función: send_range
+ * -------------------
+ * Envía un rango de un archivo por el canal de datos en bloques del tamaño
+ * que elige el ajuste de la transferencia, aplicando la política de caché
+ * de páginas (lectura anticipada y descarte).
+ *
+ * dsd: descriptor del canal de datos
+ * fd: archivo a enviar
+ * offset, size: rango a enviar
+ *
+ * return: true si se envió todo
+ */
+static bool send_range(int dsd, int fd, off_t offset, uint64_t size) {
+    struct io_policy policy;
+    size_t len;
+    bool ok = true;
+
+    uint64_t start;
+
+    io_policy_start(&policy, fd, offset, size, false);
+    while (ok && size > 0) {
+        start = TRACE_BEGIN();
+        len = size < tune.chunk ? size : tune.chunk;
+        io_policy_read(&policy, offset, len);
+        ok = data_sendfile(dsd, fd, offset, len);
+        autotune_update(&tune, len);
+        TRACE_END("sendfile", start, len);
+        offset += len;
+        size -= len;
+    }
+    io_policy_finish(&policy);
+    return ok;
+}
+
+/**
+ * Función: data_read
+ * ------------------
+ * Lee del canal de datos lo que haya disponible, hasta len bytes.
+ *
+ * return: bytes leídos, 0 si el cliente cerró, -1 si hubo error o se venció
+ * el plazo
+ */
+static ssize_t data_read(int dsd, char *buffer, size_t len) {
+    uint64_t start = TRACE_BEGIN();
+    ssize_t recv_s;
+
+    while ((recv_s = read(dsd, buffer, len)) < 0) {
+        if (errno != EAGAIN && errno != EINTR) return -1;
+        if (!wait_fd(dsd, POLLIN)) return -1;
+    }
+    tw_add(&wheel, &data_timer, limits.stall_timeout * 1000UL);
+    TRACE_END("data_read", start, recv_s);
+    return recv_s;
+}
+
+/**
+ * Función: data_close
+ * -------------------
+ * Cierra el canal de datos e informa al cliente el resultado de la transferencia.
+ *
+ * sd: descriptor del canal de control
+ * dsd: descriptor del canal de datos
+ * ok: true si la transferencia terminó correctamente
+ */
+static void data_close(int sd, int dsd, bool ok) {
+    tw_del(&wheel, &data_timer);
+    close(dsd);
+    if (expired) warnx("Data transfer stalled");
+    expired = NULL;
+    send_ans(sd, ok ? MSG_226 : MSG_426);
+}
+
+/**
+ * Función: metrics_log
+ * --------------------
+ * Agrega al archivo de métricas una línea con el resultado de la
+ * transferencia y los valores que eligió el ajuste (bloque, buffer del
+ * socket, RTT y caudal). Una sola escritura con O_APPEND: las líneas de
+ * sesiones simultáneas no se mezclan.
+ *
+ * op: comando de la transferencia
+ * path: archivo transferido
+ * ok: resultado
+ */
+static void metrics_log(const char *op, const char *path, bool ok) {
+    char line[2 * BUFSIZE];
+    int len;
+
+    if (metrics_fd < 0) return;
+    len = snprintf(line, sizeof(line), "%ld op=%s path=%s ok=%d ", (long) time(NULL), op, path, ok);
+    len += autotune_report(&tune, line + len, sizeof(line) - len - 1);
+    line[len++] = '\n';
+    if (write(metrics_fd, line, len) < 0) warn("Error writing metrics");
+}
+
+static bool sink_write(void *arg, const char *buffer, size_t len) {
+    return data_write(*(int *) arg, buffer, len);
+}
+
+static bool sink_sendfile(void *arg, int fd, off_t offset, size_t len) {
+    return send_range(*(int *) arg, fd, offset, len);
+}
+
+/**
+ * Función: archive_request
+ * ------------------------
+ * Decide si RETR pide un directorio empaquetado: el directorio mismo, o
+ * "dir.tar" / "dir.tar.gz" / "dir.tgz" cuando no existe un archivo con ese
+ * nombre. Quita el sufijo de la ruta.
+ *
+ * file_path: ruta pedida, se modifica
+ * gzip: se indica si hay que comprimir
+ *
+ * return: true si hay que enviar un tar del directorio
+ */
+static bool archive_request(char *file_path, bool *gzip) {
+    static const char *suffixes[] = { ".tar.gz", ".tgz", ".tar" };
+    struct stat st;
+    size_t len = strlen(file_path), slen;
+    unsigned i;
+
+    *gzip = false;
+    if (stat(file_path, &st) == 0) return S_ISDIR(st.st_mode);
+
+    for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        slen = strlen(suffixes[i]);
+        if (len <= slen || strcmp(file_path + len - slen, suffixes[i]) != 0) continue;
+        file_path[len - slen] = '\0';
+        if (stat(file_path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            *gzip = i < 2;
+            return true;
+        }
+        file_path[len - slen] = suffixes[i][0];
+        return false;
+    }
+    return false;
+}
+
+/**
+ * Función: retr_tar
+ * -----------------
+ * Envía un directorio completo como un tar generado al vuelo por una sola
+ * conexión de datos. El tamaño no se conoce de antemano, así que se anuncia
+ * con 150 y el fin del tar lo marca el cierre del canal de datos.
+ *
+ * sd: descriptor de socket del canal de control
+ * addr: dirección de datos indicada con PORT
+ * dir: directorio a enviar
+ * gzip: comprimir el tar
+ */
+static void retr_tar(int sd, struct sockaddr_in addr, char *dir, bool gzip) {
+    int dsd;
+    struct tar_sink sink = { sink_write, sink_sendfile, &dsd };
+
+    bool ok;
+
+    send_ans(sd, MSG_150_TAR, dir, gzip ? "tar.gz" : "tar");
+    if ((dsd = data_connect(addr)) < 0) {
+        send_ans(sd, MSG_425);
+        return;
+    }
+    autotune_start(&tune, dsd, true);
+    ok = tar_stream(dir, gzip, &sink);
+    data_close(sd, dsd, ok);
+    metrics_log("RETR", dir, ok);
+}
+
+/**
+ * Función: retr_local
+ * -------------------
+ * RETR en una sesión local: en lugar de los datos se pasa al cliente un
+ * descriptor de sólo lectura y el cliente copia por su cuenta. Un archivo
+ * del paquete va con el desplazamiento de su rango ("at offset"); un
+ * directorio se envía como tar por un pipe cuyo extremo de lectura recibe
+ * el cliente.
+ *
+ * sd: descriptor de socket del canal de control
+ * file_path: ruta pedida
+ */
+static void retr_local(int sd, char *file_path) {
+    struct stat st;
+    int fd, pipefd[2];
+    uint64_t offset, size;
+    bool gzip;
+    struct tar_sink sink = { sink_write, sink_sendfile, &pipefd[1] };
+
+    if (pack_lookup(file_path, &fd, &offset, &size)) {
+        if (send_ans_fd(sd, fd, MSG_299_AT, file_path, (long) size, (unsigned long long) offset))
+            send_ans(sd, MSG_226);
+        return;
+    }
+
+    if (archive_request(file_path, &gzip)) {
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
+            send_ans(sd, MSG_425);
+            return;
+        }
+        fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+        if (!send_ans_fd(sd, pipefd[0], MSG_150_TAR, file_path, gzip ? "tar.gz" : "tar")) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return;
+        }
+        close(pipefd[0]);
+        autotune_start(&tune, pipefd[1], true);
+        tw_add(&wheel, &data_timer, limits.stall_timeout * 1000UL);
+        data_close(sd, pipefd[1], tar_stream(file_path, gzip, &sink));
+        return;
+    }
+
+    // Sólo archivos regulares: un dispositivo o un FIFO no deben salir del
+    // servidor como descriptor. Sin O_NONBLOCK, abrir un FIFO bloquea la
+    // sesión antes del fstat; el cliente recibe el descriptor ya bloqueante
+    if ((fd = open(file_path, O_RDONLY | O_NONBLOCK | O_NOCTTY)) < 0 || fstat(fd, &st) < 0 ||
+        !S_ISREG(st.st_mode) || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0) {
+        if (fd >= 0) close(fd);
+        send_ans(sd, MSG_550, file_path);
+        return;
+    }
+    if (send_ans_fd(sd, fd, MSG_299, file_path, (long) st.st_size)) send_ans(sd, MSG_226);
+    close(fd);
+}
+
 /**
  * Función: retr
  * -------------
  * Maneja el comando RETR (retrieve) para enviar un archivo al cliente.
- * Abre el archivo, envía su contenido al cliente y cierra el archivo.
+ * Abre el archivo, envía su contenido por el canal de datos y cierra el archivo.
+ * Si hay un archivo empaquetado (-a) y contiene la ruta, se sirve desde él.
+ * Si la ruta es un directorio, se envía como tar (ver retr_tar). En una
+ * sesión local se pasa un descriptor (ver retr_local).
  * 
- * sd: descriptor de socket para enviar el archivo
+ * sd: descriptor de socket del canal de control
+ * addr: dirección de datos indicada con PORT
  * file_path: ruta del archivo a enviar
  */
-void retr(int sd, char *file_path) {
-    FILE *file;
-    int bread;
-    long fsize;
-    char buffer[BUFSIZE];
+void retr(int sd, struct sockaddr_in addr, char *file_path) {
+    struct stat st;
+    int fd, dsd, pack_fd;
+    bool ok;
+    uint64_t offset, size;
+    bool gzip;
+
+    if (local_session) {
+        retr_local(sd, file_path);
+        return;
+    }
+
+    // Los archivos del paquete se sirven con una búsqueda en el índice y un
+    // sendfile() del rango, sin abrir nada
+    if (pack_lookup(file_path, &pack_fd, &offset, &size)) {
+        send_ans(sd, MSG_299, file_path, (long) size);
+        if ((dsd = data_connect(addr)) < 0) {
+            send_ans(sd, MSG_425);
+            return;
+        }
+        autotune_start(&tune, dsd, true);
+        ok = send_range(dsd, pack_fd, offset, size);
+        data_close(sd, dsd, ok);
+        metrics_log("RETR", file_path, ok);
+        return;
+    }
+
+    if (archive_request(file_path, &gzip)) {
+        retr_tar(sd, addr, file_path, gzip);
+        return;
+    }
 
     // Verificar si el archivo existe; si no, informar error al cliente
-    file = fopen(file_path, "r");
-    if (file == NULL) {
+    if ((fd = open(file_path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
         warn("Error opening file");
+        if (fd >= 0) close(fd);
         send_ans(sd, MSG_550, file_path);
         return;
     }
 
     // Enviar un mensaje de éxito con el tamaño del archivo
-    fseek(file, 0L, SEEK_END);
-    fsize = ftell(file);
-    fseek(file, 0L, SEEK_SET);
-    send_ans(sd, MSG_299, file_path, fsize);
-
-    // Importante retraso para evitar problemas con el tamaño del búfer
-    sleep(1);
-
-    // Enviar el archivo
-    while ((bread = fread(buffer, 1, BUFSIZE, file)) > 0) {
-        if (write(sd, buffer, bread) < 0) {
-            warn("Error sending file");
-            fclose(file);
-            return;
-        }
+    send_ans(sd, MSG_299, file_path, (long) st.st_size);
+
+    // Conectar al canal de datos del cliente
+    if ((dsd = data_connect(addr)) < 0) {
+        close(fd);
+        send_ans(sd, MSG_425);
+        return;
     }
 
-    // Cerrar el archivo
-    fclose(file);
+    // Enviar el archivo sin copiarlo, con lectura anticipada y descarte
+    // según su tamaño
+    autotune_start(&tune, dsd, true);
+    if (!(ok = send_range(dsd, fd, 0, st.st_size))) warn("Error sending file");
+    close(fd);
 
-    // Enviar un mensaje de transferencia completada
-    send_ans(sd, MSG_226);
+    // Cerrar el canal de datos e informar el resultado
+    data_close(sd, dsd, ok);
+    metrics_log("RETR", file_path, ok);
 }
 
 /**
@@ -195,6 +744,44 @@ bool check_credentials(char *user, char *pass) {
     return found;
 }
 
+/**
+ * Función: sessions_lock
+ * ----------------------
+ * Toma el lock de la tabla de sesiones. Si el hijo que lo tenía murió con
+ * él tomado, el lock se recupera: la sección crítica sólo escribe el
+ * usuario de la entrada propia, que a lo sumo queda truncado hasta que el
+ * principal la libere al recoger a ese hijo.
+ */
+static void sessions_lock(void) {
+    if (pthread_mutex_lock(&sessions->lock) == EOWNERDEAD) pthread_mutex_consistent(&sessions->lock);
+}
+
+/**
+ * Función: claim_user
+ * -------------------
+ * Asocia el usuario a la entrada de esta sesión si no supera el máximo de
+ * sesiones simultáneas por usuario.
+ *
+ * user: nombre de usuario autenticado
+ *
+ * return: true si se admitió la sesión, false si el usuario está al límite
+ */
+static bool claim_user(const char *user) {
+    int i, count = 0;
+    bool admitted;
+
+    if (own_slot < 0) return true;
+
+    sessions_lock();
+    for (i = 0; i < sessions->size; i++)
+        if (sessions->slots[i].pid != 0 && strcmp(sessions->slots[i].user, user) == 0) count++;
+    admitted = count < limits.max_per_user;
+    if (admitted) snprintf(sessions->slots[own_slot].user, PARSIZE, "%s", user);
+    pthread_mutex_unlock(&sessions->lock);
+
+    return admitted;
+}
+
 /**
  * Función: authenticate
  * ---------------------
@@ -208,6 +795,9 @@ bool check_credentials(char *user, char *pass) {
 
 bool authenticate(int sd) {
     char user[PARSIZE], pass[PARSIZE];
+    struct in_addr ip = { htonl(INADDR_LOOPBACK) };
+
+    if (own_slot >= 0) ip = sessions->slots[own_slot].ip;
 
     // Esperar a recibir el comando USER
     if (!recv_cmd(sd, "USER", user)) return false;
@@ -218,54 +808,32 @@ bool authenticate(int sd) {
     // Esperar a recibir el comando PASS
     if (!recv_cmd(sd, "PASS", pass)) return false;
 
+    // Con la dirección o el usuario bloqueados por intentos fallidos se
+    // rechaza sin leer el archivo de credenciales
+    if (loginlimit_ip_blocked(ip) || loginlimit_user_blocked(user)) {
+        send_ans(sd, MSG_530);
+        return false;
+    }
+
     // Si las credenciales no son válidas, denegar el inicio de sesión
     if (!check_credentials(user, pass)) {
+        loginlimit_failed(ip, user);
         send_ans(sd, MSG_530);
         return false;
     }
+    loginlimit_succeeded(user);
+
+    // Rechazar si el usuario ya tiene demasiadas sesiones abiertas
+    if (!claim_user(user)) {
+        send_ans(sd, MSG_421_USER, user);
+        return false;
+    }
 
     // Confirmar inicio de sesión
-    send_ans(sd, MSG_230);
+    send_ans(sd, MSG_230, user);
     return true;
 }
 
-/**
- * Función: operate
- * ----------------
- * Maneja la operación principal del servidor FTP.
- * Espera recibir comandos del cliente y los procesa en un bucle infinito.
- * Soporta los comandos RETR (retrieve) y QUIT.
- * 
- * sd: descriptor de socket para comunicarse con el cliente
- */
-void operate(int sd) {
-    char op[CMDSIZE], param[PARSIZE];
-
-    while (true) {
-        op[0] = param[0] = '\0';
-
-        // Verificar si se reciben comandos del cliente; si no, informar y salir
-        if (!recv_cmd(sd, op, param)) {
-            send_ans(sd, MSG_221);
-            break;
-        }
-
-        if (strcmp(op, "RETR") == 0) {
-            retr(sd, param);
-        } else if (strcmp(op, "QUIT") == 0) {
-            // Enviar mensaje de despedida y cerrar la conexión
-            send_ans(sd, MSG_221);
-            close(sd);
-            break;
-        } else {
-            // Comando inválido
-            // send_ans(sd, MSG_500);
-            // Uso futuro
-            // send_ans(sd, MSG_502);
-        }
-    }
-}
-
 /**
  * Funcion: port
  * -------------------
@@ -287,9 +855,18 @@ struct sockaddr_in port(int sd, char *socketdata){
     struct sockaddr_in addr;
     int puerto, i, j, count;
     char *ip, *aux1, *aux2;
-    ip = (char*)malloc(30*sizeof(char));
-    aux1 = (char*)malloc(4*sizeof(char));
-    aux2 = (char*)malloc(4*sizeof(char));
+    size_t mark = arena_mark(&session_arena), len = strlen(socketdata) + 1;
+
+    // Reservas temporales en la arena de la sesión, acotadas por el parámetro
+    ip = arena_alloc(&session_arena, len);
+    aux1 = arena_alloc(&session_arena, len);
+    aux2 = arena_alloc(&session_arena, len);
+    memset(&addr, 0, sizeof(addr));
+    if (ip == NULL || aux1 == NULL || aux2 == NULL) {
+        arena_release(&session_arena, mark);
+        send_ans(sd, MSG_425);
+        return addr;
+    }
 
     i = j = 0;
     count=0;
@@ -337,80 +914,312 @@ struct sockaddr_in port(int sd, char *socketdata){
     addr.sin_addr.s_addr = inet_addr(ip);
     addr.sin_port = htons(puerto);
 
-    free(ip);
-    free(aux1);
-    free(aux2);
+    arena_release(&session_arena, mark);
 
     send_ans(sd, MSG_200);
 
     return addr;
 }
 
+/**
+ * Función: stor_local
+ * -------------------
+ * STOR en una sesión local: el cliente adjuntó al comando un descriptor
+ * de su archivo y el servidor lo copia dentro del kernel con
+ * copy_file_range() (sendfile() si los archivos están en distintos
+ * sistemas de archivos), sin canal de datos.
+ *
+ * sd: descriptor de socket del canal de control
+ * file_path: archivo a crear
+ * size: bytes a copiar desde el inicio del descriptor recibido
+ */
+static void stor_local(int sd, char *file_path, long size) {
+    struct io_policy policy;
+    struct stat st;
+    int src = received_fd, fd;
+    off_t in = 0, offset = 0;
+    ssize_t n;
+    size_t len;
+    bool ok = true;
+    uint64_t start;
+
+    // El descriptor pasa a ser de esta función. Se exige un archivo regular
+    // legible: un pipe o un socket podrían bloquear la sesión
+    received_fd = -1;
+    if (fstat(src, &st) < 0 || !S_ISREG(st.st_mode) || (fcntl(src, F_GETFL) & O_ACCMODE) == O_WRONLY) {
+        close(src);
+        send_ans(sd, MSG_425);
+        return;
+    }
+    if ((fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        warn("Error opening file");
+        close(src);
+        send_ans(sd, MSG_426);
+        return;
+    }
+
+    io_policy_start(&policy, fd, 0, size, true);
+    while (ok && size > 0) {
+        start = TRACE_BEGIN();
+        len = size < SEND_CHUNK ? size : SEND_CHUNK;
+        n = copy_file_range(src, &in, fd, NULL, len, 0);
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            n = sendfile(fd, src, &in, len);
+        // 0: el archivo del cliente es más corto que lo anunciado
+        if (n <= 0) {
+            if (n < 0) warn("Error copying file");
+            ok = false;
+            break;
+        }
+        io_policy_written(&policy, offset, n);
+        TRACE_END("copy", start, n);
+        offset += n;
+        size -= n;
+    }
+    if (ok) ok = wb_sync(fd);
+    io_policy_finish(&policy);
+    close(fd);
+    close(src);
+    send_ans(sd, ok ? MSG_226 : MSG_426);
+}
+
 /**
  * Función: stor
  * ---------------------------------
  * Recibe un archivo enviado por el cliente a través de una conexión de datos.
+ * Si el comando trajo un descriptor (sesión local), se copia de él (ver
+ * stor_local).
  *
  * sd El descriptor de socket de la conexión de control.
  * addr La estructura sockaddr_in que contiene la información de la conexión de datos.
  * file_data Los datos del archivo que se van a recibir.
  */
 void stor(int sd, struct sockaddr_in addr, char *file_data) {
-    FILE *file;
-    long f_size, recv_s, r_size = BUFSIZE;
-    char buffer[BUFSIZE];
-    int srcsd;
+    struct io_policy policy;
+    struct write_behind *wb = NULL;
+    long f_size, recv_s, r_size;
+    size_t room;
+    char *buffer;
+    int srcsd, fd;
     char *file_path, *file_size, *aux;
-
-    // Reserva memoria para las variables auxiliares
-    file_path = (char*)malloc(50*sizeof(char));
-    file_size = (char*)malloc(25*sizeof(char));
+    bool ok = true;
+    size_t mark = arena_mark(&session_arena);
+
+    // Reserva memoria para las variables auxiliares en la arena de la sesión
+    file_path = arena_alloc(&session_arena, PARSIZE);
+    file_size = arena_alloc(&session_arena, PARSIZE);
+    if (file_path == NULL || file_size == NULL) {
+        arena_release(&session_arena, mark);
+        send_ans(sd, MSG_425);
+        return;
+    }
 
     // Extrae el nombre del archivo y su tamaño de los datos del archivo
     aux = strtok(file_data, "//");
-    strcpy(file_path, aux);
+    strcpy(file_path, aux ? aux : "");
     aux = strtok(NULL, "//");
-    strcpy(file_size, aux);
-    f_size = atoi(file_size);
+    strcpy(file_size, aux ? aux : "0");
+    f_size = atol(file_size);
 
     // Envía una respuesta al cliente indicando que el servidor está listo para recibir el archivo
-    send_ans(sd, MSG_150, file_path);
+    send_ans(sd, MSG_150, file_path, f_size);
 
-    // Abre una conexión al cliente a través del socket de datos
-    srcsd = socket(AF_INET, SOCK_STREAM, 0);
-    if (srcsd < 0) errx(2, "Cannot create socket");
+    if (received_fd >= 0) {
+        stor_local(sd, file_path, f_size);
+        arena_release(&session_arena, mark);
+        return;
+    }
 
-    if (connect(srcsd, (struct sockaddr *) &addr, sizeof(addr)) < 0) errx(3, "Error on connect to data channel");
+    // Abre una conexión al cliente a través del socket de datos
+    if ((srcsd = data_connect(addr)) < 0) {
+        send_ans(sd, MSG_425);
+        arena_release(&session_arena, mark);
+        return;
+    }
 
-    // Abre el archivo en modo escritura para escribir en él
-    file = fopen(file_path, "w");
+    // Abre el archivo en modo escritura para escribir en él; la escritura
+    // a disco queda a cargo de los hilos de escritura diferida
+    if ((fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        warn("Error opening file");
+        ok = false;
+    } else {
+        io_policy_start(&policy, fd, 0, f_size, true);
+        if ((wb = wb_start(fd, &policy)) == NULL) {
+            warnx("Cannot allocate write-behind buffers");
+            ok = false;
+        }
+    }
 
-    // Recibe el archivo en bloques y escribe los datos en el archivo local
-    while (true) {
-        if (f_size < BUFSIZE) r_size = f_size;
+    // Recibe el archivo en bloques del tamaño que elige el ajuste,
+    // directamente en los buffers de escritura diferida
+    autotune_start(&tune, srcsd, false);
+    while (ok && f_size > 0) {
+        if ((buffer = wb_buffer(wb, &room)) == NULL) {
+            ok = false;
+            break;
+        }
+        r_size = f_size < (long) tune.chunk ? f_size : (long) tune.chunk;
+        if (r_size > (long) room) r_size = room;
 
         // Lee los datos del socket de datos
-        recv_s = read(srcsd, buffer, r_size);
-        if (recv_s < 0) warn("receive error");
+        recv_s = data_read(srcsd, buffer, r_size);
+        if (recv_s <= 0) {
+            warn("receive error");
+            ok = false;
+            break;
+        }
+        ok = wb_commit(wb, recv_s);
+        autotune_update(&tune, recv_s);
+        f_size -= recv_s;
+    }
+
+    // El 226 sale recién cuando los datos llegaron al punto de durabilidad
+    if (wb != NULL) ok = wb_finish(wb, ok) && ok;
+    if (fd >= 0) {
+        io_policy_finish(&policy);
+        close(fd);
+    }
+
+    // Cierra la conexión al cliente e informa si la transferencia se completó
+    data_close(sd, srcsd, ok);
+    metrics_log("STOR", file_path, ok);
+
+    // Devuelve la memoria reservada
+    arena_release(&session_arena, mark);
+
+    return;
+}
+
+/**
+ * Función: hash
+ * -------------
+ * Maneja los comandos HASH, XCRC y XSHA256: responde el hash del archivo
+ * desde el índice de hashes sin abrir un canal de datos.
+ *
+ * sd: descriptor de socket del canal de control
+ * op: comando recibido
+ * file_path: ruta del archivo
+ */
+void hash(int sd, char *op, char *file_path) {
+    struct digest digest;
+    char hex[2 * SHA256_SIZE + 1];
+    int i;
 
-        // Escribe los datos recibidos en el archivo
-        fwrite(buffer, 1, r_size, file);
+    if (!digest_lookup(file_path, &digest)) {
+        send_ans(sd, MSG_550, file_path);
+        return;
+    }
 
-        if (f_size < BUFSIZE) break;
-        f_size = f_size - BUFSIZE;
+    if (strcmp(op, "XCRC") == 0) {
+        send_ans(sd, MSG_250_CRC, digest.crc);
+        return;
     }
 
-    // Cierra la conexión al cliente
-    close(srcsd);
+    for (i = 0; i < SHA256_SIZE; i++) sprintf(hex + 2 * i, "%02x", digest.sha256[i]);
+    if (strcmp(op, "HASH") == 0) send_ans(sd, MSG_213_HASH, hex, file_path);
+    else send_ans(sd, MSG_250_SHA, hex);
+}
+
+/**
+ * Función: handoff_session
+ * ------------------------
+ * Entrega el canal de control, ya autenticado, al servidor nuevo. El
+ * cliente no lo nota: los comandos siguientes los lee el otro proceso, que
+ * también recibe la dirección de un PORT todavía sin usar.
+ *
+ * sd: descriptor del canal de control
+ * addr: dirección de datos del último PORT
+ *
+ * return: true si el servidor nuevo aceptó la sesión
+ */
+static bool handoff_session(int sd, const struct sockaddr_in *addr) {
+    struct handoff_msg msg = { .kind = HANDOFF_SESSION };
+    int hsd, fd = -1;
+    bool ok;
+
+    if (handoff_path == NULL || own_slot < 0 || (hsd = handoff_connect(handoff_path)) < 0) return false;
+    snprintf(msg.user, sizeof(msg.user), "%s", sessions->slots[own_slot].user);
+    msg.data_addr = *addr;
+    ok = handoff_send(hsd, &msg, sd) && handoff_recv(hsd, &msg, &fd) && msg.kind == HANDOFF_ACK;
+    if (fd >= 0) close(fd);
+    close(hsd);
+    return ok;
+}
+
+/**
+ * Función: operate
+ * ----------------
+ * Maneja la operación principal del servidor FTP.
+ * Espera recibir comandos del cliente y los procesa en un bucle infinito.
+ * Soporta los comandos PORT, RETR (retrieve), STOR (store), HASH, XCRC,
+ * XSHA256 y QUIT.
+ * Cada espera de comando está acotada por el tiempo de inactividad.
+ * Durante una actualización (-U) la sesión se entrega al servidor nuevo en
+ * cuanto queda inactiva.
+ * 
+ * sd: descriptor de socket para comunicarse con el cliente
+ * data_addr: dirección de datos de un PORT anterior a una actualización, o NULL
+ */
+void operate(int sd, const struct sockaddr_in *data_addr) {
+    char op[CMDSIZE], param[PARSIZE];
+    struct sockaddr_in addr;
+    bool ready;
+    uint64_t start;
 
-    // Envía un mensaje indicando que la transferencia del archivo se ha completado
-    send_ans(sd, MSG_226);
+    memset(&addr, 0, sizeof(addr));
+    if (data_addr != NULL) addr = *data_addr;
+    while (true) {
+        op[0] = param[0] = '\0';
 
-    // Libera la memoria reservada
-    free(file_path);
-    free(file_size);
+        // Esperar el próximo comando; si mientras tanto se pide una
+        // actualización, la sesión inactiva pasa al servidor nuevo
+        tw_add(&wheel, &ctl_timer, limits.idle_timeout * 1000UL);
+        idle_wait = true;
+        ready = wait_fd(sd, POLLIN);
+        idle_wait = false;
+        if (!ready && upgrade_requested && expired == NULL) {
+            upgrade_requested = 0;
+            if (handoff_session(sd, &addr)) break;
+            continue;
+        }
 
-    return;
+        // Verificar si se reciben comandos del cliente; si no, informar y salir
+        if (!ready || !recv_cmd(sd, op, param)) {
+            send_ans(sd, expired ? expired : MSG_221);
+            break;
+        }
+        tw_del(&wheel, &ctl_timer);
+
+        start = TRACE_BEGIN();
+        if (strcmp(op, "PORT") == 0) {
+            addr = port(sd, param);
+            TRACE_END("port", start, 0);
+        } else if (strcmp(op, "RETR") == 0) {
+            retr(sd, addr, param);
+            TRACE_END("retr", start, 0);
+        } else if (strcmp(op, "STOR") == 0) {
+            stor(sd, addr, param);
+            TRACE_END("stor", start, 0);
+        } else if (strcmp(op, "HASH") == 0 || strcmp(op, "XCRC") == 0 || strcmp(op, "XSHA256") == 0) {
+            hash(sd, op, param);
+            TRACE_END("hash", start, 0);
+        } else if (strcmp(op, "QUIT") == 0) {
+            // Enviar mensaje de despedida y cerrar la conexión
+            send_ans(sd, MSG_221);
+            break;
+        } else {
+            // Comando inválido
+            // send_ans(sd, MSG_500);
+            // Uso futuro
+            // send_ans(sd, MSG_502);
+        }
+
+        // Un descriptor que el comando no usó no debe quedar abierto
+        if (received_fd >= 0) {
+            close(received_fd);
+            received_fd = -1;
+        }
+    }
 }
 
 /**
@@ -435,82 +1244,612 @@ bool direccion_puerto(char *string){
 /**
  * Función: sig_handler
  * 
- * Manejador de señales para la señal SIGCHLD.
+ * Manejador de señales para la señal SIGCHLD. Recoge todos los hijos
+ * terminados y libera sus entradas en la tabla de sesiones. SIGUSR2 pide
+ * una actualización: en el principal, lanzar el binario nuevo; en un hijo,
+ * entregar la sesión en cuanto quede inactiva. SIGUSR1 pide volcar las
+ * trazas: el principal la reenvía a los hijos.
  *
  * @param sig El número de la señal recibida.
  */
 void sig_handler(int sig){
+    int saved_errno = errno, i;
+    pid_t pid;
+
     if(sig == SIGCHLD){
-        waitpid(-1, NULL, WNOHANG);
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (i = 0; i < sessions->size; i++) {
+                if (sessions->slots[i].pid == pid) {
+                    // Un hijo que murió con buffers cargados los devuelve acá
+                    __atomic_fetch_sub(&sessions->wb_buffers, sessions->slots[i].wb_buffers, __ATOMIC_RELAXED);
+                    sessions->slots[i].wb_buffers = 0;
+                    sessions->slots[i].user[0] = '\0';
+                    sessions->slots[i].pid = 0;
+                    break;
+                }
+            }
+        }
+    } else if (sig == SIGUSR2) {
+        upgrade_requested = 1;
+    } else if (sig == SIGUSR1) {
+        trace_requested = 1;
     }
+    errno = saved_errno;
 }
 
-int main(int argc, char *argv[]) {
-    // Verificación de argumentos
-    if (argc < 2) {
-        errx(1, "Port expected as argument");
-    } else if (argc > 2) {
-        errx(1, "Too many arguments");
+/**
+ * Función: sessions_create
+ * ------------------------
+ * Crea la tabla de sesiones en memoria compartida para que los hijos vean
+ * las entradas de sus hermanos.
+ *
+ * size: cantidad máxima de sesiones simultáneas
+ */
+static void sessions_create(int size) {
+    pthread_mutexattr_t attr;
+
+    sessions = mmap(NULL, sizeof(struct session_table) + size * sizeof(struct session_slot),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sessions == MAP_FAILED) err(1, "Error creating session table");
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sessions->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    sessions->size = size;
+}
+
+/**
+ * Función: peer_ip
+ * ----------------
+ * Dirección con la que cuenta una conexión para los límites: las locales
+ * (socket Unix) cuentan como 127.0.0.1.
+ */
+static struct in_addr peer_ip(const struct sockaddr_storage *addr) {
+    struct in_addr ip;
+
+    if (addr->ss_family == AF_INET) return ((const struct sockaddr_in *) addr)->sin_addr;
+    ip.s_addr = htonl(INADDR_LOOPBACK);
+    return ip;
+}
+
+/**
+ * Función: admit
+ * --------------
+ * Control de admisión: reserva una entrada para la nueva conexión si no se
+ * superan los máximos globales ni por dirección IP. Debe llamarse con SIGCHLD
+ * bloqueada para no competir con sig_handler.
+ *
+ * ip: dirección del cliente
+ *
+ * return: índice de la entrada reservada, -1 si la conexión debe rechazarse
+ */
+static int admit(struct in_addr ip) {
+    int i, free_slot = -1, per_ip = 0;
+
+    for (i = 0; i < sessions->size; i++) {
+        if (sessions->slots[i].pid == 0) {
+            if (free_slot < 0) free_slot = i;
+        } else if (sessions->slots[i].ip.s_addr == ip.s_addr) {
+            per_ip++;
+        }
     }
+    if (free_slot < 0 || per_ip >= limits.max_per_ip) return -1;
 
-    // Reservar espacio para sockets y variables
-    int master_sd, slave_sd;
-    struct sockaddr_in master_addr, slave_addr;
+    sessions->slots[free_slot].ip = ip;
+    sessions->slots[free_slot].user[0] = '\0';
+    return free_slot;
+}
+
+/**
+ * Función: serve
+ * --------------
+ * Atiende una sesión completa en el proceso hijo: saludo, autenticación
+ * acotada por el tiempo de login y operación acotada por el de inactividad.
+ *
+ * sd: descriptor de socket del cliente
+ * user: usuario de una sesión recibida de otro servidor, ya autenticada;
+ * NULL para una conexión nueva
+ * data_addr: dirección del último PORT de la sesión recibida, o NULL
+ */
+static void serve(int sd, const char *user, const struct sockaddr_in *data_addr) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int optval = 1;
+    uint64_t start;
+
+    // Muestreo de trazas por pid: sin estado compartido con el principal
+    trace_enabled = trace_dir != NULL && getpid() % trace_every == 0;
+
+    // SIGUSR2 y SIGUSR1 quedan bloqueadas salvo dentro de las esperas
+    upgrade_requested = trace_requested = 0;
+    sigprocmask(SIG_SETMASK, NULL, &wait_mask);
+    sigdelset(&wait_mask, SIGUSR2);
+    sigdelset(&wait_mask, SIGUSR1);
+
+    // Un cliente que cierra el canal de datos (o el pipe de un tar local)
+    // aborta la transferencia, no la sesión
+    signal(SIGPIPE, SIG_IGN);
+    local_session = getsockname(sd, (struct sockaddr *) &addr, &len) == 0 && addr.ss_family == AF_UNIX;
+
+    // Las respuestas son cortas y seguidas: sin Nagle cada una espera el ACK
+    // retardado de la anterior
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    // Los buffers de escritura diferida se cuentan contra el total de todas
+    // las sesiones
+    if (own_slot >= 0) wb_account(&sessions->wb_buffers, &sessions->slots[own_slot].wb_buffers);
+
+    // Memoria fija de la sesión, reservada de una vez
+    if (!arena_init(&session_arena, SESSION_ARENA_SIZE)) {
+        warnx("Cannot allocate session memory");
+        send_ans(sd, MSG_421_BUSY);
+        close(sd);
+        return;
+    }
+
+    tw_init(&wheel);
+    tw_timer_init(&ctl_timer, timeout_cb, MSG_421_LOGIN);
+    tw_timer_init(&data_timer, timeout_cb, MSG_426);
+
+    if (user != NULL) {
+        // Sesión recibida durante una actualización: el cliente no vuelve a
+        // recibir el saludo ni a autenticarse
+        ctl_timer.arg = MSG_421_IDLE;
+        if (claim_user(user)) operate(sd, data_addr);
+        else send_ans(sd, MSG_421_USER, user);
+        close(sd);
+        trace_save();
+        arena_destroy(&session_arena);
+        return;
+    }
+
+    // Enviar saludo al cliente
+    send_ans(sd, MSG_220);
+
+    // Autenticar al cliente
+    tw_add(&wheel, &ctl_timer, limits.login_timeout * 1000UL);
+    start = TRACE_BEGIN();
+    if (authenticate(sd)) {
+        // Operar solo si la autenticación es exitosa
+        TRACE_END("authenticate", start, 0);
+        tw_del(&wheel, &ctl_timer);
+        ctl_timer.arg = MSG_421_IDLE;
+        operate(sd, NULL);
+    } else if (expired) {
+        send_ans(sd, expired);
+    }
+
+    // Cerrar el socket del cliente
+    close(sd);
+    trace_save();
+    arena_destroy(&session_arena);
+}
+
+/**
+ * Función: spawn_upgrade
+ * ----------------------
+ * Ejecuta el binario de argv[0], ya reemplazado en disco, con los mismos
+ * argumentos. El proceso nuevo pide el socket de escucha por -U. Con doble
+ * fork no queda como hijo de este servidor, que va a terminar.
+ */
+static void spawn_upgrade(void) {
+    sigset_t none;
+    pid_t pid;
+
+    if ((pid = fork()) == 0) {
+        if (fork() == 0) {
+            sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, NULL);
+            signal(SIGCHLD, SIG_DFL);
+            signal(SIGUSR2, SIG_DFL);
+            execv(saved_argv[0], saved_argv);
+            warn("Cannot execute %s", saved_argv[0]);
+        }
+        _exit(0);
+    }
+    if (pid < 0) warn("Cannot start upgrade");
+    else waitpid(pid, NULL, 0);
+}
+
+/**
+ * Función: take_over
+ * ------------------
+ * Pide los sockets de escucha al servidor que corre con el mismo -U.
+ *
+ * conn: conexión con el servidor anterior, para confirmarle la recepción
+ * local: socket local heredado, -1 si el anterior no tenía
+ *
+ * return: socket de escucha heredado, -1 si no hay servidor anterior
+ */
+static int take_over(int *conn, int *local) {
+    struct handoff_msg msg = { .kind = HANDOFF_LISTEN };
+    int sd, fd = -1;
+
+    *local = -1;
+    if ((sd = handoff_connect(handoff_path)) < 0) return -1;
+    if (!handoff_send(sd, &msg, -1) || !handoff_recv(sd, &msg, &fd) || msg.kind != HANDOFF_LISTEN ||
+        fd < 0 || !handoff_recv(sd, &msg, local) || msg.kind != HANDOFF_LOCAL) {
+        warnx("Previous server did not hand over its socket");
+        if (fd >= 0) close(fd);
+        if (*local >= 0) close(*local);
+        *local = -1;
+        close(sd);
+        return -1;
+    }
+    *conn = sd;
+    return fd;
+}
+
+/**
+ * Función: give_listener
+ * ----------------------
+ * Entrega los sockets de escucha al servidor nuevo y espera que confirme que
+ * ya escucha en el socket de actualización. Mientras tanto las conexiones
+ * entrantes esperan en la cola del socket: nunca se rechazan.
+ *
+ * sd: conexión con el servidor nuevo
+ *
+ * return: true si el servidor nuevo tomó el relevo
+ */
+static bool give_listener(int sd) {
+    struct handoff_msg msg = { .kind = HANDOFF_LISTEN };
+    struct handoff_msg local = { .kind = HANDOFF_LOCAL };
+    int fd = -1;
+
+    // La ruta queda libre para que el servidor nuevo cree su socket; la del
+    // socket local no, el nuevo sigue usando el mismo
+    unlink(handoff_path);
+    if (handoff_send(sd, &msg, master_sd) && handoff_send(sd, &local, local_sd) &&
+        handoff_recv(sd, &msg, &fd) && msg.kind == HANDOFF_ACK)
+        return true;
+
+    warnx("Upgrade failed, keeping the current server");
+    if (fd >= 0) close(fd);
+    close(handoff_sd);
+    handoff_sd = handoff_listen(handoff_path);
+    return false;
+}
+
+/**
+ * Función: adopt_session
+ * ----------------------
+ * Atiende en un hijo nuevo una sesión autenticada entregada por un hijo del
+ * servidor anterior. Si no se admite, no se confirma y el hijo anterior
+ * sigue atendiéndola.
+ *
+ * sd: conexión con el hijo anterior
+ * fd: canal de control recibido
+ * msg: mensaje de entrega, con el usuario autenticado y el último PORT
+ */
+static void adopt_session(int sd, int fd, const struct handoff_msg *msg) {
+    struct handoff_msg ack = { .kind = HANDOFF_ACK };
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    sigset_t chld, prev;
+    int slot;
+    pid_t pid;
+
+    if (getpeername(fd, (struct sockaddr *) &peer, &len) < 0) return;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &prev);
+    if ((slot = admit(peer_ip(&peer))) < 0) {
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
+    if ((pid = fork()) == 0) {
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        close(master_sd);
+        if (local_sd >= 0) close(local_sd);
+        close(handoff_sd);
+        close(sd);
+        own_slot = slot;
+        serve(fd, msg->user, &msg->data_addr);
+        exit(0);
+    }
+    if (pid > 0) sessions->slots[slot].pid = pid;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    if (pid < 0) warn("Error forking session");
+    else handoff_send(sd, &ack, -1);
+}
+
+/**
+ * Función: handoff_event
+ * ----------------------
+ * Atiende una conexión en el socket de actualización: un servidor nuevo
+ * que pide el socket de escucha o un hijo del anterior que entrega su
+ * sesión.
+ *
+ * return: true si se entregó el socket de escucha y hay que terminar
+ */
+static bool handoff_event(void) {
+    struct handoff_msg msg;
+    int sd, fd;
+    bool given = false;
+
+    if ((sd = handoff_accept(handoff_sd)) < 0) return false;
+    if (handoff_recv(sd, &msg, &fd)) {
+        if (msg.kind == HANDOFF_LISTEN) given = give_listener(sd);
+        else if (msg.kind == HANDOFF_SESSION && fd >= 0) adopt_session(sd, fd, &msg);
+    }
+    if (fd >= 0) close(fd);
+    close(sd);
+    return given;
+}
+
+/**
+ * Función: drain
+ * --------------
+ * Termina el servidor anterior tras una actualización: deja de aceptar,
+ * pide a los hijos que entreguen sus sesiones inactivas y espera a que
+ * terminen las transferencias en curso.
+ */
+static void drain(void) {
+    sigset_t chld, prev;
+    int i, active;
+
+    close(master_sd);
+    if (local_sd >= 0) close(local_sd);
+    close(handoff_sd);
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &prev);
+    sigdelset(&prev, SIGCHLD);
+    while (true) {
+        for (i = 0, active = 0; i < sessions->size; i++) {
+            if (sessions->slots[i].pid == 0) continue;
+            kill(sessions->slots[i].pid, SIGUSR2);
+            active++;
+        }
+        if (active == 0) break;
+        sigsuspend(&prev);
+    }
+    exit(0);
+}
+
+/**
+ * Función: listen_port
+ * --------------------
+ * Crea el socket de escucha del servidor en el puerto indicado.
+ *
+ * port: puerto TCP
+ *
+ * return: descriptor del socket de escucha; termina el proceso si falla
+ */
+static int listen_port(int port) {
+    struct sockaddr_in master_addr;
+    int sd;
 
     // Crear el socket del servidor y comprobar errores
-    if ((master_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         err(1, "Error creating socket");
     }
 
     // Establecer las opciones del socket maestro
     int optval = 1;
-    if (setsockopt(master_sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
         err(1, "Error setting socket options");
     }
 
     // Asignar dirección al socket maestro y comprobar errores
     memset(&master_addr, 0, sizeof(master_addr));
     master_addr.sin_family = AF_INET;
-    master_addr.sin_port = htons(atoi(argv[1]));
+    master_addr.sin_port = htons(port);
     master_addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(master_sd, (struct sockaddr *)&master_addr, sizeof(master_addr)) < 0) {
+    if (bind(sd, (struct sockaddr *)&master_addr, sizeof(master_addr)) < 0) {
         err(1, "Error binding socket");
     }
 
     // Establecer el socket en modo de escucha
-    if (listen(master_sd, SOMAXCONN) < 0) {
+    if (listen(sd, SOMAXCONN) < 0) {
         err(1, "Error listening on socket");
     }
 
-    // Bucle principal
-    while (true) {
-        pid_t pid;
-        // Aceptar conexiones secuencialmente y comprobar errores
-        socklen_t slave_addr_len = sizeof(slave_addr);
-        if ((slave_sd = accept(master_sd, (struct sockaddr *)&slave_addr, &slave_addr_len)) < 0) {
-            err(1, "Error accepting connection");
-        }
+    return sd;
+}
 
+/**
+ * Función: accept_session
+ * -----------------------
+ * Acepta una conexión en un socket de escucha (TCP o local) y la atiende
+ * en un hijo nuevo. Las conexiones que superan los límites se rechazan
+ * rápido, sin fork.
+ *
+ * lsd: socket de escucha listo para aceptar
+ */
+static void accept_session(int lsd) {
+    struct sockaddr_storage slave_addr;
+    socklen_t slave_addr_len = sizeof(slave_addr);
+    sigset_t chld, prev;
+    int slave_sd, slot;
+    pid_t pid;
+
+    // Aceptar conexiones y comprobar errores
+    if ((slave_sd = accept(lsd, (struct sockaddr *)&slave_addr, &slave_addr_len)) < 0) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) return;
+        err(1, "Error accepting connection");
+    }
 
-        signal(SIGCHLD, sig_handler);
+    // Una dirección bloqueada por intentos fallidos no llega a crear un hijo
+    if (loginlimit_ip_blocked(peer_ip(&slave_addr))) {
+        send_ans(slave_sd, MSG_421_BLOCKED);
+        close(slave_sd);
+        return;
+    }
 
-        pid = fork();
-        if(pid == 0){
-            close(master_sd);
-            break;
-        }
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &prev);
+    if ((slot = admit(peer_ip(&slave_addr))) < 0) {
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        send_ans(slave_sd, MSG_421_BUSY);
+        close(slave_sd);
+        return;
+    }
+
+    pid = fork();
+    if(pid == 0){
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        close(master_sd);
+        if (local_sd >= 0) close(local_sd);
+        if (handoff_sd >= 0) close(handoff_sd);
+        own_slot = slot;
+        serve(slave_sd, NULL, NULL);
+        exit(0);
+    }
+    if (pid < 0) warn("Error forking session");
+    else sessions->slots[slot].pid = pid;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
 
-        // Enviar saludo al cliente
-        send_ans(slave_sd, MSG_220);
+    // El hijo atiende la sesión; el principal vuelve a aceptar
+    close(slave_sd);
+}
 
-        // Autenticar al cliente
-        if (authenticate(slave_sd)) {
-            // Operar solo si la autenticación es exitosa
-            operate(slave_sd);
+/**
+ * Función: usage
+ * --------------
+ * Informa la forma de uso y termina.
+ */
+static void usage(void) {
+    errx(1, "usage: servidor [-m max_sessions] [-i max_per_ip] [-u max_per_user]\n"
+            "\t[-L login_timeout] [-I idle_timeout] [-D data_timeout] [-S stall_timeout]\n"
+            "\t[-x digest_index] [-w digest_threads] [-a pack] [-B bulk_threshold_mb]\n"
+            "\t[-U handoff_socket] [-l local_socket] [-T min_kb:max_kb[:buffer_kb]]\n"
+            "\t[-M metrics_file] [-t trace_dir[:every]] [-f ip_failures:user_failures[:window]]\n"
+            "\t[-W write_behind_mb[:threads[:transfer_mb]]] [-Y written|fdatasync|fsync] port");
+}
+
+int main(int argc, char *argv[]) {
+    char *aux;
+    int opt, i;
+
+    // Verificación de argumentos
+    while ((opt = getopt(argc, argv, "m:i:u:L:I:D:S:x:w:a:B:U:l:T:M:t:f:W:Y:")) != -1) {
+        switch (opt) {
+            case 'm': limits.max_sessions = atoi(optarg); break;
+            case 'i': limits.max_per_ip = atoi(optarg); break;
+            case 'u': limits.max_per_user = atoi(optarg); break;
+            case 'L': limits.login_timeout = atoi(optarg); break;
+            case 'I': limits.idle_timeout = atoi(optarg); break;
+            case 'D': limits.data_timeout = atoi(optarg); break;
+            case 'S': limits.stall_timeout = atoi(optarg); break;
+            case 'x': digest_index = optarg; break;
+            case 'w': digest_threads = atoi(optarg); break;
+            case 'a': if (!pack_open(optarg)) exit(1); break;
+            case 'B': io_bulk_threshold = (off_t) atol(optarg) * 1024 * 1024; break;
+            case 'U': handoff_path = optarg; break;
+            case 'l': local_path = optarg; break;
+            case 'T': if (!tune_limits_parse(optarg)) usage(); break;
+            case 'f': if (!login_limits_parse(optarg)) usage(); break;
+            case 'W': if (!wb_limits_parse(optarg)) usage(); break;
+            case 'Y': if (!wb_sync_parse(optarg)) usage(); break;
+            case 't':
+                // Se copia el directorio: argv se vuelve a ejecutar tal cual
+                // en una actualización (-U)
+                trace_dir = optarg;
+                if ((aux = strrchr(optarg, ':')) != NULL) {
+                    if ((trace_every = atoi(aux + 1)) <= 0) usage();
+                    if ((trace_dir = strndup(optarg, aux - optarg)) == NULL) err(1, "strndup");
+                }
+                break;
+            case 'M':
+                if ((metrics_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+                    err(1, "%s", optarg);
+                break;
+            default: usage();
         }
+    }
+    if (argc - optind < 1) {
+        errx(1, "Port expected as argument");
+    } else if (argc - optind > 1) {
+        errx(1, "Too many arguments");
+    }
+    if (!direccion_puerto(argv[optind])) {
+        errx(1, "Invalid port");
+    }
+    if (limits.max_sessions <= 0) usage();
 
-        // Cerrar el socket del cliente
-        close(slave_sd);
+    // Reservar espacio para sockets y variables
+    int handoff_conn = -1, inherited_local = -1;
+    struct pollfd pfds[3];
+    sigset_t block;
+
+    saved_argv = argv;
+
+    // En una actualización, heredar los sockets de escucha del servidor que
+    // corre con el mismo -U en lugar de crearlos
+    if (handoff_path == NULL || (master_sd = take_over(&handoff_conn, &inherited_local)) < 0)
+        master_sd = listen_port(atoi(argv[optind]));
+    else
+        warnx("Took over the listening socket");
+
+    // Socket local: cualquier usuario del sistema puede conectarse, el
+    // acceso lo decide la autenticación FTP
+    if (local_path == NULL) {
+        if (inherited_local >= 0) close(inherited_local);
+    } else if ((local_sd = inherited_local) < 0 && (local_sd = unix_listen(local_path, 0111)) < 0) {
+        exit(1);
+    }
+
+    sessions_create(limits.max_sessions);
+    if (!loginlimit_init()) exit(1);
+
+    // Índice de hashes compartido con los hijos y cálculo en segundo plano
+    if (digest_index != NULL && digest_open(digest_index, DIGEST_CAPACITY))
+        digest_start(".", digest_threads);
+    signal(SIGCHLD, sig_handler);
+
+    // El principal espera en todos sus sockets a la vez, así que ninguno
+    // bloquea en accept(). Con -U (SIGUSR2) y -t (SIGUSR1) las señales sólo
+    // se reciben dentro de la espera, así no se pierden entre la
+    // comprobación y ppoll()
+    fcntl(master_sd, F_SETFD, FD_CLOEXEC);
+    fcntl(master_sd, F_SETFL, fcntl(master_sd, F_GETFL) | O_NONBLOCK);
+    if (local_sd >= 0) fcntl(local_sd, F_SETFL, fcntl(local_sd, F_GETFL) | O_NONBLOCK);
+    sigprocmask(SIG_SETMASK, NULL, &wait_mask);
+    sigemptyset(&block);
+    if (handoff_path != NULL) {
+        if ((handoff_sd = handoff_listen(handoff_path)) < 0) exit(1);
+        sigaddset(&block, SIGUSR2);
+        signal(SIGUSR2, sig_handler);
+    }
+    if (trace_dir != NULL) {
+        sigaddset(&block, SIGUSR1);
+        signal(SIGUSR1, sig_handler);
+    }
+    sigprocmask(SIG_BLOCK, &block, NULL);
+    if (handoff_conn >= 0) {
+        // Confirmar al servidor anterior: ya puede dejar de aceptar
+        struct handoff_msg ack = { .kind = HANDOFF_ACK };
+
+        handoff_send(handoff_conn, &ack, -1);
+        close(handoff_conn);
+    }
+
+    // Bucle principal; poll() ignora las entradas con descriptor -1
+    while (true) {
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            spawn_upgrade();
+        }
+        if (trace_requested) {
+            trace_requested = 0;
+            for (i = 0; i < sessions->size; i++)
+                if (sessions->slots[i].pid != 0) kill(sessions->slots[i].pid, SIGUSR1);
+        }
+        pfds[0].fd = master_sd;
+        pfds[1].fd = local_sd;
+        pfds[2].fd = handoff_sd;
+        pfds[0].events = pfds[1].events = pfds[2].events = POLLIN;
+        if (ppoll(pfds, 3, NULL, &wait_mask) < 0) continue;
+        if ((pfds[2].revents & POLLIN) && handoff_event()) drain();
+        if (pfds[1].revents & POLLIN) accept_session(local_sd);
+        if (pfds[0].revents & POLLIN) accept_session(master_sd);
     }
 
     // Cerrar el socket del servidor
@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "arena.h"
+#include "tarstream.h"
+#include "trace.h"
+
+#define TAR_BLOCK 512
+#define TAR_SLOTS 32            // entradas en vuelo entre el recorrido y el envío
+#define TAR_SMALL (64 * 1024)   // los archivos hasta este tamaño se leen por adelantado
+#define TAR_READERS 4
+#define TAR_DEPTH 64
+#define TAR_PATHSIZE 1024
+#define TAR_CHUNK (64 * 1024)   // buffer de salida y de lectura al comprimir
+#define TAR_ZLIB_MEMORY (320 * 1024)
+
+/**
+ * Una entrada del tar en preparación. El recorrido completa la ruta y el
+ * tipo; un lector abre el archivo y, si es pequeño, lo lee entero. El
+ * emisor las envía en el orden del recorrido.
+ */
+enum slot_state { SLOT_FREE, SLOT_QUEUED, SLOT_LOADING, SLOT_READY };
+
+struct tar_slot {
+    enum slot_state state;
+    bool dir;
+    bool skip;              // desapareció o dejó de ser un archivo regular
+    int fd;                 // abierto para archivos grandes, -1 si no
+    struct stat st;
+    char *data;             // contenido leído por adelantado
+    char path[TAR_PATHSIZE];
+};
+
+/**
+ * Cola circular de entradas compartida por el emisor y los lectores. head y
+ * tail crecen sin límite; la casilla es el índice módulo TAR_SLOTS.
+ */
+struct tar_job {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned head, tail;
+    bool stop;
+    struct tar_slot slots[TAR_SLOTS];
+};
+
+// Recorrido en profundidad con un directorio abierto por nivel
+struct walker {
+    DIR *dirs[TAR_DEPTH];
+    size_t lens[TAR_DEPTH];
+    int depth;
+    char path[TAR_PATHSIZE];
+};
+
+// Salida del tar: sin compresión se agrupan las escrituras pequeñas en buf
+struct tar_out {
+    const struct tar_sink *sink;
+    bool gzip;
+    z_stream z;
+    char *buf;
+    size_t used;
+    char *chunk;
+};
+
+static const char zeros[2 * TAR_BLOCK];
+
+/**
+ * Función: walker_next
+ * --------------------
+ * Avanza el recorrido hasta el siguiente directorio o archivo regular. Los
+ * enlaces simbólicos y archivos especiales no se incluyen.
+ *
+ * return: false cuando no quedan entradas
+ */
+static bool walker_next(struct walker *walker, struct tar_slot *slot) {
+    struct dirent *entry;
+    size_t len;
+    DIR *dir;
+
+    while (walker->depth > 0) {
+        if ((entry = readdir(walker->dirs[walker->depth - 1])) == NULL) {
+            closedir(walker->dirs[--walker->depth]);
+            continue;
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        len = walker->lens[walker->depth - 1];
+        if (len + 1 + strlen(entry->d_name) >= TAR_PATHSIZE) continue;
+        len += sprintf(walker->path + len, "/%s", entry->d_name);
+        if (lstat(walker->path, &slot->st) < 0) continue;
+
+        if (S_ISDIR(slot->st.st_mode)) {
+            if (walker->depth == TAR_DEPTH || (dir = opendir(walker->path)) == NULL) {
+                warn("Skipping directory %s", walker->path);
+                continue;
+            }
+            walker->dirs[walker->depth] = dir;
+            walker->lens[walker->depth++] = len;
+        } else if (!S_ISREG(slot->st.st_mode)) {
+            continue;
+        }
+
+        memcpy(slot->path, walker->path, len + 1);
+        slot->dir = S_ISDIR(slot->st.st_mode);
+        slot->skip = false;
+        slot->fd = -1;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Función: load
+ * -------------
+ * Prepara un archivo en un hilo lector. Los pequeños se leen enteros; los
+ * grandes quedan abiertos y con lectura anticipada pedida al kernel, para
+ * enviarlos después sin copiarlos.
+ */
+static void load(struct tar_slot *slot) {
+    size_t got = 0, size;
+    ssize_t n;
+    uint64_t start = TRACE_BEGIN();
+
+    if ((slot->fd = open(slot->path, O_RDONLY | O_NOFOLLOW)) < 0 ||
+        fstat(slot->fd, &slot->st) < 0 || !S_ISREG(slot->st.st_mode)) {
+        if (slot->fd >= 0) close(slot->fd);
+        slot->fd = -1;
+        slot->skip = true;
+        return;
+    }
+
+    if (slot->st.st_size > TAR_SMALL) {
+        posix_fadvise(slot->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(slot->fd, 0, 16 * TAR_CHUNK, POSIX_FADV_WILLNEED);
+        TRACE_END("tar_open", start, slot->st.st_size);
+        return;
+    }
+
+    // Si el archivo se acorta mientras se lee, se completa con ceros para
+    // respetar el tamaño ya anunciado en la cabecera
+    size = slot->st.st_size;
+    while (got < size && (n = pread(slot->fd, slot->data + got, size - got, got)) > 0) got += n;
+    memset(slot->data + got, 0, size - got);
+    close(slot->fd);
+    slot->fd = -1;
+    TRACE_END("tar_read", start, size);
+}
+
+static void *reader(void *arg) {
+    struct tar_job *job = arg;
+    struct tar_slot *slot;
+    unsigned i;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->stop) {
+        // La entrada pendiente más antigua es la que el emisor necesita antes
+        slot = NULL;
+        for (i = job->head; i != job->tail && slot == NULL; i++)
+            if (job->slots[i % TAR_SLOTS].state == SLOT_QUEUED) slot = &job->slots[i % TAR_SLOTS];
+        if (slot == NULL) {
+            pthread_cond_wait(&job->cond, &job->lock);
+            continue;
+        }
+
+        slot->state = SLOT_LOADING;
+        pthread_mutex_unlock(&job->lock);
+        load(slot);
+        pthread_mutex_lock(&job->lock);
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static bool out_flush(struct tar_out *out) {
+    bool ok = out->used == 0 || out->sink->write(out->sink->arg, out->buf, out->used);
+
+    out->used = 0;
+    return ok;
+}
+
+/**
+ * Función: out_write
+ * ------------------
+ * Agrega bytes al tar. Sin compresión se acumulan en el buffer para enviar
+ * muchas cabeceras y archivos pequeños en una sola escritura.
+ *
+ * flush: Z_NO_FLUSH, o Z_FINISH para cerrar el flujo comprimido
+ */
+static bool out_write(struct tar_out *out, const char *data, size_t len, int flush) {
+    size_t have;
+
+    if (!out->gzip) {
+        if (out->used + len > TAR_CHUNK) {
+            if (!out_flush(out)) return false;
+            if (len > TAR_CHUNK) return out->sink->write(out->sink->arg, data, len);
+        }
+        memcpy(out->buf + out->used, data, len);
+        out->used += len;
+        return flush == Z_NO_FLUSH || out_flush(out);
+    }
+
+    out->z.next_in = (Bytef *) data;
+    out->z.avail_in = len;
+    do {
+        out->z.next_out = (Bytef *) out->buf;
+        out->z.avail_out = TAR_CHUNK;
+        if (deflate(&out->z, flush) == Z_STREAM_ERROR) return false;
+        have = TAR_CHUNK - out->z.avail_out;
+        if (have > 0 && !out->sink->write(out->sink->arg, out->buf, have)) return false;
+    } while (out->z.avail_out == 0);
+    return true;
+}
+
+/**
+ * Función: out_file
+ * -----------------
+ * Agrega el contenido de un archivo grande: con sendfile() si el tar va sin
+ * comprimir, leyéndolo por bloques si hay que comprimirlo.
+ */
+static bool out_file(struct tar_out *out, int fd, uint64_t size) {
+    uint64_t offset = 0;
+    ssize_t n;
+
+    if (!out->gzip) return out_flush(out) && out->sink->sendfile(out->sink->arg, fd, 0, size);
+
+    while (offset < size) {
+        n = pread(fd, out->chunk, size - offset < TAR_CHUNK ? size - offset : TAR_CHUNK, offset);
+        if (n <= 0 || !out_write(out, out->chunk, n, Z_NO_FLUSH)) return false;
+        offset += n;
+    }
+    return true;
+}
+
+/**
+ * Función: tar_number
+ * -------------------
+ * Escribe un campo numérico en octal o, si no entra, en base 256 (extensión
+ * GNU, necesaria para archivos de 8 GiB o más).
+ */
+static void tar_number(char *field, size_t len, uint64_t value) {
+    size_t i;
+
+    if (value < (1ULL << (3 * (len - 1)))) {
+        snprintf(field, len, "%0*llo", (int) (len - 1), (unsigned long long) value);
+        return;
+    }
+    for (i = len - 1; i > 0; i--, value >>= 8) field[i] = value & 0xff;
+    field[0] = (char) 0x80;
+}
+
+/**
+ * Función: put_header
+ * -------------------
+ * Emite la cabecera de una entrada. Los nombres de más de 100 caracteres
+ * van antes en una entrada ././@LongLink, como hace GNU tar.
+ */
+static bool put_header(struct tar_out *out, const char *name, char type, const struct stat *st, uint64_t size) {
+    char block[TAR_BLOCK];
+    size_t len = strlen(name), i;
+    unsigned sum = 0;
+
+    if (len > 100 && (!put_header(out, "././@LongLink", 'L', NULL, len + 1) ||
+                      !out_write(out, name, len + 1, Z_NO_FLUSH) ||
+                      !out_write(out, zeros, (TAR_BLOCK - (len + 1) % TAR_BLOCK) % TAR_BLOCK, Z_NO_FLUSH)))
+        return false;
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, name, len < 100 ? len : 100);
+    tar_number(block + 100, 8, st ? st->st_mode & 07777 : 0644);
+    tar_number(block + 108, 8, 0);
+    tar_number(block + 116, 8, 0);
+    tar_number(block + 124, 12, size);
+    tar_number(block + 136, 12, st ? (uint64_t) st->st_mtime : 0);
+    memset(block + 148, ' ', 8);
+    block[156] = type;
+    memcpy(block + 257, "ustar  ", 8);
+
+    for (i = 0; i < sizeof(block); i++) sum += (unsigned char) block[i];
+    snprintf(block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+
+    return out_write(out, block, sizeof(block), Z_NO_FLUSH);
+}
+
+/**
+ * Función: emit
+ * -------------
+ * Envía una entrada ya preparada: cabecera, contenido y relleno.
+ *
+ * name: nombre de la entrada, relativo al directorio pedido
+ */
+static bool emit(struct tar_out *out, struct tar_slot *slot, const char *name) {
+    char dir_name[TAR_PATHSIZE + 1];
+    uint64_t size = slot->st.st_size;
+    bool ok;
+
+    if (slot->skip) return true;
+    if (slot->dir) {
+        snprintf(dir_name, sizeof(dir_name), "%s/", name);
+        return put_header(out, dir_name, '5', &slot->st, 0);
+    }
+
+    if (!put_header(out, name, '0', &slot->st, size)) return false;
+    if (slot->fd >= 0) ok = out_file(out, slot->fd, size);
+    else ok = out_write(out, slot->data, size, Z_NO_FLUSH);
+    return ok && out_write(out, zeros, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK, Z_NO_FLUSH);
+}
+
+static void *zalloc(void *opaque, unsigned items, unsigned size) {
+    return arena_alloc(opaque, (size_t) items * size);
+}
+
+static void zfree(void *opaque, void *address) {
+    (void) opaque;
+    (void) address;
+}
+
+/**
+ * Función: tar_stream
+ * -------------------
+ * Genera al vuelo un tar con el contenido de dir y lo envía al destino. El
+ * recorrido y el envío van en el hilo que llama; TAR_READERS hilos abren y
+ * leen por adelantado las próximas TAR_SLOTS entradas. Toda la memoria,
+ * incluida la de zlib, sale de una arena de tamaño fijo.
+ *
+ * dir: directorio a empaquetar; los nombres del tar son relativos a él
+ * gzip: comprimir el tar con gzip
+ * sink: destino del flujo
+ *
+ * return: true si se envió el tar completo
+ */
+bool tar_stream(const char *dir, bool gzip, const struct tar_sink *sink) {
+    struct arena arena;
+    struct tar_job *job;
+    struct tar_slot *slot;
+    struct tar_out out = { .sink = sink, .gzip = gzip };
+    struct walker walker;
+    pthread_t threads[TAR_READERS];
+    sigset_t all, prev;
+    size_t root_len;
+    int i, nthreads = 0;
+    bool ok = true, more = true;
+    unsigned j;
+
+    memset(&walker, 0, sizeof(walker));
+    root_len = strlen(dir);
+    while (root_len > 1 && dir[root_len - 1] == '/') root_len--;
+    if (root_len >= TAR_PATHSIZE) return false;
+    memcpy(walker.path, dir, root_len);
+    walker.path[root_len] = '\0';
+    walker.lens[0] = root_len;
+    if ((walker.dirs[0] = opendir(walker.path)) == NULL) return false;
+    walker.depth = 1;
+
+    if (!arena_init(&arena, sizeof(*job) + TAR_SLOTS * (size_t) TAR_SMALL + 2 * TAR_CHUNK +
+                            (gzip ? TAR_ZLIB_MEMORY : 0) + 1024)) {
+        closedir(walker.dirs[0]);
+        return false;
+    }
+    job = arena_alloc(&arena, sizeof(*job));
+    out.buf = arena_alloc(&arena, TAR_CHUNK);
+    out.chunk = arena_alloc(&arena, TAR_CHUNK);
+    for (i = 0; i < TAR_SLOTS; i++) job->slots[i].data = arena_alloc(&arena, TAR_SMALL);
+
+    if (gzip) {
+        out.z.zalloc = zalloc;
+        out.z.zfree = zfree;
+        out.z.opaque = &arena;
+        // Nivel rápido: el cuello de botella no debe pasar a ser la CPU
+        if (deflateInit2(&out.z, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            warnx("Cannot initialize compression");
+            closedir(walker.dirs[0]);
+            arena_destroy(&arena);
+            return false;
+        }
+    }
+
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+    while (nthreads < TAR_READERS && pthread_create(&threads[nthreads], NULL, reader, job) == 0) nthreads++;
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+    if (nthreads == 0) ok = false;
+
+    while (ok) {
+        // Completar las casillas libres con las próximas entradas; las libres
+        // pertenecen al emisor, así que se llenan fuera del lock
+        while (more && job->tail - job->head < TAR_SLOTS) {
+            slot = &job->slots[job->tail % TAR_SLOTS];
+            if (!(more = walker_next(&walker, slot))) break;
+            pthread_mutex_lock(&job->lock);
+            slot->state = slot->dir ? SLOT_READY : SLOT_QUEUED;
+            job->tail++;
+            pthread_cond_broadcast(&job->cond);
+            pthread_mutex_unlock(&job->lock);
+        }
+        if (job->head == job->tail) break;
+
+        // Enviar la entrada más antigua en cuanto esté lista
+        slot = &job->slots[job->head % TAR_SLOTS];
+        pthread_mutex_lock(&job->lock);
+        while (slot->state != SLOT_READY) pthread_cond_wait(&job->cond, &job->lock);
+        pthread_mutex_unlock(&job->lock);
+
+        ok = emit(&out, slot, slot->path + root_len + 1);
+        if (slot->fd >= 0) close(slot->fd);
+        slot->fd = -1;
+
+        pthread_mutex_lock(&job->lock);
+        slot->state = SLOT_FREE;
+        job->head++;
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    // Fin del tar: dos bloques en cero
+    if (ok) ok = out_write(&out, zeros, sizeof(zeros), Z_FINISH);
+
+    pthread_mutex_lock(&job->lock);
+    job->stop = true;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+
+    for (j = job->head; j != job->tail; j++)
+        if (job->slots[j % TAR_SLOTS].fd >= 0) close(job->slots[j % TAR_SLOTS].fd);
+    while (walker.depth > 0) closedir(walker.dirs[--walker.depth]);
+    if (gzip) deflateEnd(&out.z);
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    arena_destroy(&arena);
+    return ok;
+}
@@ -0,0 +1,21 @@
+#ifndef TARSTREAM_H
+#define TARSTREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Destino del flujo tar. write envía bytes generados; sendfile envía un
+ * rango de un archivo sin copiarlo (sólo se usa sin compresión). Ambas
+ * devuelven false si la transferencia debe abortarse.
+ */
+struct tar_sink {
+    bool (*write)(void *arg, const char *buffer, size_t len);
+    bool (*sendfile)(void *arg, int fd, off_t offset, size_t len);
+    void *arg;
+};
+
+bool tar_stream(const char *dir, bool gzip, const struct tar_sink *sink);
+
+#endif
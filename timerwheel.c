@@ -0,0 +1,173 @@
+#include <stddef.h>
+#include <time.h>
+
+#include "timerwheel.h"
+
+/**
+ * Función: tw_now_ms
+ * ------------------
+ * Devuelve el reloj monotónico en milisegundos.
+ */
+uint64_t tw_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Función: tw_init
+ * ----------------
+ * Inicializa una rueda vacía posicionada en el instante actual.
+ */
+void tw_init(struct timer_wheel *tw) {
+    int l, s;
+
+    tw->now = tw_now_ms() / TW_TICK_MS;
+    tw->count = 0;
+    for (l = 0; l < TW_LEVELS; l++)
+        for (s = 0; s < TW_SLOTS; s++)
+            tw->slots[l][s] = NULL;
+}
+
+/**
+ * Función: tw_timer_init
+ * ----------------------
+ * Prepara un temporizador inactivo con la función a invocar al vencer.
+ */
+void tw_timer_init(struct tw_timer *t, void (*callback)(void *), void *arg) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->callback = callback;
+    t->arg = arg;
+}
+
+bool tw_pending(const struct tw_timer *t) {
+    return t->pprev != NULL;
+}
+
+/**
+ * Función: place
+ * --------------
+ * Ubica el temporizador en la casilla que le corresponde según la distancia
+ * entre su vencimiento y el tick actual.
+ */
+static void place(struct timer_wheel *tw, struct tw_timer *t) {
+    uint64_t delta = t->expires - tw->now;
+    struct tw_timer **head;
+    int level = 0;
+
+    while (level < TW_LEVELS - 1 && delta >= (uint64_t)1 << (TW_BITS * (level + 1)))
+        level++;
+
+    // Más allá del último nivel se recorta al máximo representable
+    if (delta >= (uint64_t)1 << (TW_BITS * TW_LEVELS)) {
+        delta = ((uint64_t)1 << (TW_BITS * TW_LEVELS)) - 1;
+        t->expires = tw->now + delta;
+    }
+
+    head = &tw->slots[level][(t->expires >> (TW_BITS * level)) & TW_MASK];
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void unlink_timer(struct tw_timer *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/**
+ * Función: tw_add
+ * ---------------
+ * Arma (o rearma) el temporizador para vencer dentro de timeout_ms.
+ */
+void tw_add(struct timer_wheel *tw, struct tw_timer *t, unsigned long timeout_ms) {
+    uint64_t ticks = (timeout_ms + TW_TICK_MS - 1) / TW_TICK_MS;
+
+    tw_del(tw, t);
+    t->expires = tw->now + (ticks ? ticks : 1);
+    place(tw, t);
+    tw->count++;
+}
+
+/**
+ * Función: tw_del
+ * ---------------
+ * Desarma el temporizador; no hace nada si no estaba pendiente.
+ */
+void tw_del(struct timer_wheel *tw, struct tw_timer *t) {
+    if (!tw_pending(t)) return;
+    unlink_timer(t);
+    tw->count--;
+}
+
+/**
+ * Función: cascade
+ * ----------------
+ * Redistribuye la casilla del nivel indicado en los niveles inferiores.
+ * return: el índice de la casilla, 0 indica que también hay que bajar el
+ * nivel siguiente
+ */
+static int cascade(struct timer_wheel *tw, int level) {
+    int index = (tw->now >> (TW_BITS * level)) & TW_MASK;
+    struct tw_timer *t = tw->slots[level][index], *next;
+
+    tw->slots[level][index] = NULL;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        place(tw, t);
+    }
+    return index;
+}
+
+/**
+ * Función: tw_advance
+ * -------------------
+ * Avanza la rueda hasta el instante actual ejecutando los temporizadores
+ * vencidos. Las funciones invocadas pueden volver a armar temporizadores.
+ */
+void tw_advance(struct timer_wheel *tw) {
+    uint64_t target = tw_now_ms() / TW_TICK_MS;
+    struct tw_timer *t;
+    int level;
+
+    while (tw->now < target) {
+        tw->now++;
+        for (level = 1; level < TW_LEVELS; level++)
+            if ((tw->now & (((uint64_t)1 << (TW_BITS * level)) - 1)) != 0 || cascade(tw, level) != 0)
+                break;
+
+        while ((t = tw->slots[0][tw->now & TW_MASK]) != NULL) {
+            unlink_timer(t);
+            tw->count--;
+            t->callback(t->arg);
+        }
+    }
+}
+
+/**
+ * Función: tw_next_timeout
+ * ------------------------
+ * Calcula cuántos milisegundos se puede esperar sin perder un vencimiento,
+ * en el formato que espera poll().
+ * return: -1 si no hay temporizadores pendientes
+ */
+int tw_next_timeout(const struct timer_wheel *tw) {
+    uint64_t tick, now_ms = tw_now_ms(), next_ms;
+
+    if (tw->count == 0) return -1;
+
+    // Primer vencimiento en el nivel 0; si no hay, hasta la próxima cascada
+    for (tick = tw->now + 1; tick <= tw->now + TW_SLOTS; tick++) {
+        if (tw->slots[0][tick & TW_MASK] != NULL) break;
+        if ((tick & TW_MASK) == 0) break;
+    }
+
+    next_ms = tick * TW_TICK_MS;
+    return next_ms > now_ms ? (int)(next_ms - now_ms) : 0;
+}
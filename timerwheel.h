@@ -0,0 +1,45 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TW_TICK_MS 10   // resolución de la rueda en milisegundos
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4     // 64^4 ticks de 10 ms, unas 46 horas
+
+/**
+ * Temporizador de la rueda. Se reserva dentro de la estructura que lo usa,
+ * la rueda nunca pide memoria.
+ */
+struct tw_timer {
+    struct tw_timer *next, **pprev;
+    uint64_t expires;               // tick de vencimiento
+    void (*callback)(void *arg);
+    void *arg;
+};
+
+/**
+ * Rueda de temporizadores jerárquica: cada nivel tiene TW_SLOTS casillas y
+ * cubre TW_SLOTS veces el rango del nivel anterior. Agregar y quitar son O(1);
+ * los temporizadores de niveles altos bajan de nivel (cascada) a medida que
+ * se acerca su vencimiento.
+ */
+struct timer_wheel {
+    uint64_t now;                   // tick actual
+    unsigned count;                 // temporizadores pendientes
+    struct tw_timer *slots[TW_LEVELS][TW_SLOTS];
+};
+
+uint64_t tw_now_ms(void);
+void tw_init(struct timer_wheel *tw);
+void tw_timer_init(struct tw_timer *t, void (*callback)(void *), void *arg);
+bool tw_pending(const struct tw_timer *t);
+void tw_add(struct timer_wheel *tw, struct tw_timer *t, unsigned long timeout_ms);
+void tw_del(struct timer_wheel *tw, struct tw_timer *t);
+void tw_advance(struct timer_wheel *tw);
+int tw_next_timeout(const struct timer_wheel *tw);
+
+#endif
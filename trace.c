@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_EVENTS 4096   // eventos por hilo; los más viejos se sobrescriben
+#define TRACE_RINGS 16      // anillos conservados; luego se reusan los de hilos terminados
+
+struct trace_event {
+    const char *name;
+    uint64_t start, dur;    // ns de CLOCK_MONOTONIC
+    uint64_t arg;
+};
+
+/**
+ * Anillo de un hilo. Sólo su hilo escribe; next cuenta los eventos
+ * registrados, así que el evento i está en events[i % TRACE_EVENTS].
+ */
+struct trace_ring {
+    struct trace_ring *next_ring;
+    pid_t tid;
+    bool finished;          // el hilo terminó; el anillo se puede reusar
+    uint64_t next;
+    struct trace_event events[TRACE_EVENTS];
+};
+
+bool trace_enabled;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static struct trace_ring *rings;
+static unsigned nrings;
+static __thread struct trace_ring *own_ring;
+
+// Al terminar el hilo su anillo queda para el volcado, pero se puede reusar
+static void ring_finished(void *arg) {
+    __atomic_store_n(&((struct trace_ring *) arg)->finished, true, __ATOMIC_RELEASE);
+}
+
+static void make_key(void) {
+    pthread_key_create(&ring_key, ring_finished);
+}
+
+/**
+ * Función: ring_get
+ * -----------------
+ * Devuelve el anillo del hilo, creándolo en su primer evento. Pasado
+ * TRACE_RINGS se reusa el de un hilo ya terminado.
+ */
+static struct trace_ring *ring_get(void) {
+    struct trace_ring *ring;
+
+    if (own_ring != NULL) return own_ring;
+    pthread_once(&key_once, make_key);
+
+    pthread_mutex_lock(&rings_lock);
+    for (ring = nrings < TRACE_RINGS ? NULL : rings; ring != NULL; ring = ring->next_ring)
+        if (__atomic_load_n(&ring->finished, __ATOMIC_ACQUIRE)) break;
+    if (ring == NULL && (ring = malloc(sizeof(*ring))) != NULL) {
+        ring->next_ring = rings;
+        rings = ring;
+        nrings++;
+    }
+    if (ring != NULL) {
+        ring->tid = gettid();
+        ring->finished = false;
+        __atomic_store_n(&ring->next, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (ring != NULL) pthread_setspecific(ring_key, ring);
+    return own_ring = ring;
+}
+
+uint64_t trace_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Función: trace_span
+ * -------------------
+ * Registra un intervalo que empezó en start y termina ahora.
+ *
+ * name: nombre del intervalo (cadena estática)
+ * start: valor de TRACE_BEGIN() al empezar
+ * arg: dato asociado, por ejemplo bytes transferidos
+ */
+void trace_span(const char *name, uint64_t start, uint64_t arg) {
+    struct trace_ring *ring = ring_get();
+    struct trace_event *event;
+    uint64_t now = trace_clock();
+
+    if (ring == NULL) return;
+    event = &ring->events[ring->next % TRACE_EVENTS];
+    event->name = name;
+    event->start = start ? start : now;
+    event->dur = now - event->start;
+    event->arg = arg;
+    __atomic_store_n(&ring->next, ring->next + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Función: trace_dump
+ * -------------------
+ * Escribe los eventos de todos los hilos como JSON de eventos de traza de
+ * Chrome (intervalos completos "X", en microsegundos). Los anillos de
+ * otros hilos se leen sin detenerlos: un evento que se sobrescribe durante
+ * el volcado puede salir mezclado.
+ *
+ * return: false si hubo un error de escritura
+ */
+bool trace_dump(FILE *out) {
+    struct trace_ring *ring;
+    struct trace_event event;
+    uint64_t i, next, first;
+    bool comma = false;
+    pid_t pid = getpid();
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    pthread_mutex_lock(&rings_lock);
+    for (ring = rings; ring != NULL; ring = ring->next_ring) {
+        next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+        first = next > TRACE_EVENTS ? next - TRACE_EVENTS : 0;
+        for (i = first; i < next; i++) {
+            event = ring->events[i % TRACE_EVENTS];
+            fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%llu}}",
+                    comma ? "," : "", event.name, (int) pid, (int) ring->tid,
+                    event.start / 1e3, event.dur / 1e3, (unsigned long long) event.arg);
+            comma = true;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    fprintf(out, "\n]}\n");
+    return fflush(out) == 0 && !ferror(out);
+}
+
+/**
+ * Función: trace_write
+ * --------------------
+ * Vuelca los eventos en el archivo path, reemplazándolo.
+ */
+bool trace_write(const char *path) {
+    FILE *out = fopen(path, "w");
+    bool ok;
+
+    if (out == NULL) return false;
+    ok = trace_dump(out);
+    return fclose(out) == 0 && ok;
+}
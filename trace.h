@@ -0,0 +1,32 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Trazas de tiempo para perfilar sesiones lentas. Cada hilo registra
+ * intervalos con nombre en su propio anillo, sin locks; al volcarlos se
+ * obtiene un JSON de eventos de traza de Chrome (chrome://tracing o
+ * Perfetto). Con trace_enabled en false cada punto de traza cuesta una
+ * lectura y un salto.
+ *
+ *     uint64_t t = TRACE_BEGIN();
+ *     ...
+ *     TRACE_END("retr", t, bytes);
+ *
+ * Los nombres deben ser cadenas estáticas: se guarda sólo el puntero.
+ */
+extern bool trace_enabled;
+
+#define TRACE_BEGIN() (trace_enabled ? trace_clock() : 0)
+#define TRACE_END(name, start, arg) \
+    do { if (trace_enabled) trace_span(name, start, arg); } while (0)
+
+uint64_t trace_clock(void);
+void trace_span(const char *name, uint64_t start, uint64_t arg);
+bool trace_dump(FILE *out);
+bool trace_write(const char *path);
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "untar.h"
+
+#define TAR_BLOCK 512
+#define UNTAR_PATHSIZE 1024
+#define INFLATE_CHUNK (64 * 1024)
+
+enum untar_state {
+    UT_HEADER,      // acumulando una cabecera
+    UT_DATA,        // contenido de una entrada
+    UT_LONGNAME,    // nombre largo de la próxima entrada (././@LongLink)
+    UT_END          // se recibieron los bloques finales
+};
+
+struct untar {
+    enum untar_state state;
+    bool gzip, z_done, error;
+    z_stream z;
+    char block[TAR_BLOCK];
+    size_t block_len;
+    uint64_t remaining;     // bytes de contenido pendientes de la entrada
+    size_t pad;             // relleno pendiente hasta el próximo bloque
+    int fd;                 // archivo en extracción, -1 si se descarta
+    time_t mtime;
+    int zero_blocks;
+    size_t longname_len;
+    bool have_longname;
+    char longname[UNTAR_PATHSIZE];
+    char root[UNTAR_PATHSIZE];
+    char out[INFLATE_CHUNK];
+};
+
+/**
+ * Función: untar_new
+ * ------------------
+ * Crea el extractor y el directorio raíz si no existe.
+ *
+ * root: directorio donde se extrae el tar
+ * gzip: el flujo viene comprimido con gzip
+ */
+struct untar *untar_new(const char *root, bool gzip) {
+    struct untar *untar;
+
+    if (strlen(root) >= UNTAR_PATHSIZE / 2 || (mkdir(root, 0755) < 0 && errno != EEXIST)) return NULL;
+    if ((untar = calloc(1, sizeof(*untar))) == NULL) return NULL;
+    strcpy(untar->root, root);
+    untar->gzip = gzip;
+    untar->fd = -1;
+    if (gzip && inflateInit2(&untar->z, 15 + 16) != Z_OK) {
+        free(untar);
+        return NULL;
+    }
+    return untar;
+}
+
+void untar_free(struct untar *untar) {
+    if (untar == NULL) return;
+    if (untar->fd >= 0) close(untar->fd);
+    if (untar->gzip) inflateEnd(&untar->z);
+    free(untar);
+}
+
+/**
+ * Función: tar_number
+ * -------------------
+ * Lee un campo numérico en octal o en base 256 (extensión GNU).
+ */
+static uint64_t tar_number(const char *field, size_t len) {
+    uint64_t value = 0;
+    size_t i = 0;
+
+    if ((unsigned char) field[0] & 0x80) {
+        for (i = 1; i < len; i++) value = (value << 8) | (unsigned char) field[i];
+        return value;
+    }
+    while (i < len && field[i] == ' ') i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+/**
+ * Función: safe_name
+ * ------------------
+ * Rechaza nombres absolutos o con componentes "..", que escribirían fuera
+ * del directorio raíz.
+ */
+static bool safe_name(const char *name) {
+    const char *p = name;
+
+    if (name[0] == '/' || name[0] == '\0') return false;
+    while (p != NULL) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) return false;
+        if ((p = strchr(p, '/')) != NULL) p++;
+    }
+    return true;
+}
+
+// Crea los directorios intermedios de path, que empieza con la raíz
+static void make_parents(char *path, size_t root_len) {
+    char *slash;
+
+    for (slash = strchr(path + root_len + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+/**
+ * Función: end_entry
+ * ------------------
+ * Termina la entrada actual y vuelve a esperar una cabecera.
+ */
+static void end_entry(struct untar *untar) {
+    struct timespec times[2];
+
+    if (untar->state == UT_LONGNAME) {
+        untar->longname[untar->longname_len] = '\0';
+        untar->have_longname = true;
+    }
+    if (untar->fd >= 0) {
+        times[0].tv_sec = times[1].tv_sec = untar->mtime;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        futimens(untar->fd, times);
+        if (close(untar->fd) < 0) untar->error = true;
+        untar->fd = -1;
+    }
+    untar->state = UT_HEADER;
+}
+
+/**
+ * Función: header
+ * ---------------
+ * Procesa una cabecera completa: valida la suma de control y prepara el
+ * destino del contenido que sigue.
+ */
+static void header(struct untar *untar) {
+    char name[UNTAR_PATHSIZE], path[2 * UNTAR_PATHSIZE];
+    const char *block = untar->block;
+    unsigned sum = 0, i;
+    uint64_t size;
+    size_t root_len = strlen(untar->root);
+    char type = block[156];
+
+    for (i = 0; i < TAR_BLOCK && block[i] == 0; i++);
+    if (i == TAR_BLOCK) {
+        if (++untar->zero_blocks == 2) untar->state = UT_END;
+        return;
+    }
+    untar->zero_blocks = 0;
+
+    for (i = 0; i < TAR_BLOCK; i++) sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) block[i];
+    if (sum != tar_number(block + 148, 8)) {
+        untar->error = true;
+        return;
+    }
+
+    // Nombre: el largo de la entrada anterior, o prefijo POSIX y nombre
+    if (untar->have_longname) {
+        snprintf(name, sizeof(name), "%s", untar->longname);
+    } else if (memcmp(block + 257, "ustar", 6) == 0 && block[345] != '\0') {
+        snprintf(name, sizeof(name), "%.155s/%.100s", block + 345, block);
+    } else {
+        snprintf(name, sizeof(name), "%.100s", block);
+    }
+    untar->have_longname = false;
+
+    size = tar_number(block + 124, 12);
+    untar->remaining = size;
+    untar->pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    untar->mtime = tar_number(block + 136, 12);
+    untar->state = UT_DATA;
+
+    if (type == 'L') {
+        if (size >= sizeof(untar->longname)) untar->error = true;
+        untar->longname_len = 0;
+        untar->state = UT_LONGNAME;
+    } else if (type == '0' || type == '\0' || type == '5') {
+        if (!safe_name(name)) {
+            untar->error = true;
+            return;
+        }
+        snprintf(path, sizeof(path), "%s/%s", untar->root, name);
+        make_parents(path, root_len);
+        if (type == '5') {
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) untar->error = true;
+        } else if ((untar->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC,
+                                     tar_number(block + 100, 8) & 0777)) < 0) {
+            untar->error = true;
+        }
+    }
+    // Otros tipos (enlaces, dispositivos) se descartan
+
+    if (untar->remaining == 0 && untar->pad == 0) end_entry(untar);
+}
+
+/**
+ * Función: consume
+ * ----------------
+ * Procesa bytes del tar ya descomprimido.
+ */
+static bool consume(struct untar *untar, const char *data, size_t len) {
+    size_t n, done;
+    ssize_t written;
+
+    while (len > 0 && !untar->error && untar->state != UT_END) {
+        if (untar->state == UT_HEADER) {
+            n = TAR_BLOCK - untar->block_len < len ? TAR_BLOCK - untar->block_len : len;
+            memcpy(untar->block + untar->block_len, data, n);
+            untar->block_len += n;
+            data += n;
+            len -= n;
+            if (untar->block_len < TAR_BLOCK) continue;
+            untar->block_len = 0;
+            header(untar);
+            continue;
+        }
+
+        if (untar->remaining > 0) {
+            n = untar->remaining < len ? untar->remaining : len;
+            if (untar->state == UT_LONGNAME) {
+                memcpy(untar->longname + untar->longname_len, data, n);
+                untar->longname_len += n;
+            } else if (untar->fd >= 0) {
+                for (done = 0; done < n; done += written) {
+                    if ((written = write(untar->fd, data + done, n - done)) < 0) {
+                        untar->error = true;
+                        break;
+                    }
+                }
+            }
+            untar->remaining -= n;
+        } else {
+            n = untar->pad < len ? untar->pad : len;
+            untar->pad -= n;
+        }
+        data += n;
+        len -= n;
+        if (untar->remaining == 0 && untar->pad == 0) end_entry(untar);
+    }
+    return !untar->error;
+}
+
+/**
+ * Función: untar_feed
+ * -------------------
+ * Entrega el siguiente trozo del flujo, descomprimiéndolo si hace falta.
+ *
+ * return: false si el tar es inválido o no se pudo escribir un archivo
+ */
+bool untar_feed(struct untar *untar, const char *data, size_t len) {
+    int ret;
+
+    if (!untar->gzip) return consume(untar, data, len);
+
+    untar->z.next_in = (Bytef *) data;
+    untar->z.avail_in = len;
+    while (!untar->z_done && !untar->error) {
+        untar->z.next_out = (Bytef *) untar->out;
+        untar->z.avail_out = sizeof(untar->out);
+        ret = inflate(&untar->z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) untar->error = true;
+        else if (!consume(untar, untar->out, sizeof(untar->out) - untar->z.avail_out)) break;
+        if (ret == Z_STREAM_END) untar->z_done = true;
+        // Sin más entrada y con salida sobrante, el trozo está procesado
+        if (untar->z.avail_in == 0 && untar->z.avail_out > 0) break;
+    }
+    return !untar->error;
+}
+
+/**
+ * Función: untar_finish
+ * ---------------------
+ * Indica si el flujo terminó completo: el fin del tar y, si va comprimido,
+ * el del gzip.
+ */
+bool untar_finish(struct untar *untar) {
+    return !untar->error && untar->state == UT_END && (!untar->gzip || untar->z_done);
+}
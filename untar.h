@@ -0,0 +1,19 @@
+#ifndef UNTAR_H
+#define UNTAR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Extractor incremental de tar (opcionalmente gzip): recibe el flujo en
+ * trozos de cualquier tamaño a medida que llega y crea los directorios y
+ * archivos bajo un directorio raíz.
+ */
+struct untar;
+
+struct untar *untar_new(const char *root, bool gzip);
+bool untar_feed(struct untar *untar, const char *data, size_t len);
+bool untar_finish(struct untar *untar);
+void untar_free(struct untar *untar);
+
+#endif
@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "trace.h"
+#include "writebehind.h"
+
+#define WB_BUFFER_SIZE (1024 * 1024)
+#define WB_MAX_BUFFERS 256
+#define WB_MAX_THREADS 8
+#define WB_IOV 16               // buffers que se juntan como máximo en una escritura
+#define WB_BUDGET_WAIT 1        // ms entre reintentos con el presupuesto global agotado
+
+struct wb_buffer {
+    char *data;
+    size_t len;
+    bool done;              // escrito, a la espera de los anteriores
+};
+
+/**
+ * Estado de una transferencia, dentro de su propia arena. Los buffers
+ * forman una cola circular; head, next y tail crecen sin límite y la
+ * casilla es el índice módulo count:
+ *
+ *   [head, next)  tomados por un hilo de escritura o ya escritos
+ *   [next, tail)  llenos, en cola
+ *   tail          el que está llenando la red
+ *
+ * Cada buffer se carga al presupuesto global antes de que la red empiece
+ * a llenarlo y se descarga cuando head lo pasa.
+ */
+struct write_behind {
+    struct arena arena;
+    int fd;
+    struct io_policy *policy;
+    pthread_mutex_t lock;
+    pthread_mutex_t policy_lock;    // mantiene en orden las llamadas a la política
+    pthread_cond_t cond;
+    unsigned count, head, next, tail;
+    off_t head_offset, next_offset;
+    bool closing, failed;
+    unsigned charged;               // buffers cargados al presupuesto global
+    bool tail_charged;              // el de tail ya está cargado
+    unsigned nthreads;
+    pthread_t threads[WB_MAX_THREADS];
+    struct wb_buffer buffers[];
+};
+
+struct wb_limits wb_limits = { 256 * WB_BUFFER_SIZE, 16 * WB_BUFFER_SIZE, 2, WB_WRITTEN };
+
+// Buffers cargados por todas las sesiones y por ésta, en la tabla de
+// sesiones compartida; NULL sin ella, y entonces sólo rige el tope de cada
+// transferencia
+static unsigned *used_total, *used_own;
+
+/**
+ * Función: wb_limits_parse
+ * ------------------------
+ * Lee la memoria total en MiB, los hilos y el tope de una transferencia en
+ * MiB con la forma "mb[:threads[:transfer_mb]]". El tope no supera el
+ * total.
+ *
+ * return: false si la especificación es inválida
+ */
+bool wb_limits_parse(const char *spec) {
+    long mb, transfer = wb_limits.transfer / WB_BUFFER_SIZE;
+    int threads = wb_limits.threads, n;
+
+    n = sscanf(spec, "%ld:%d:%ld", &mb, &threads, &transfer);
+    if (n < 1 || mb <= 0 || mb > UINT32_MAX / 2 || threads < 0 || threads > WB_MAX_THREADS || transfer <= 0 ||
+        transfer > WB_MAX_BUFFERS)
+        return false;
+    wb_limits.budget = mb * WB_BUFFER_SIZE;
+    wb_limits.transfer = (transfer < mb ? transfer : mb) * WB_BUFFER_SIZE;
+    wb_limits.threads = threads;
+    return true;
+}
+
+/**
+ * Función: wb_account
+ * -------------------
+ * Indica dónde llevar la cuenta de buffers de todas las sesiones y de la
+ * de este proceso. El proceso principal descuenta del total lo que quede
+ * en la cuenta de un hijo que terminó sin devolverlo.
+ */
+void wb_account(unsigned *total, unsigned *own) {
+    used_total = total;
+    used_own = own;
+}
+
+/**
+ * Función: charge
+ * ---------------
+ * Carga un buffer al presupuesto global si queda lugar, o siempre si force
+ * es true. El total se incrementa antes que la cuenta propia: un hijo que
+ * muere en el medio deja a lo sumo un buffer de más, nunca de menos.
+ */
+static bool charge(bool force) {
+    unsigned used;
+
+    if (used_total == NULL) return true;
+    used = __atomic_load_n(used_total, __ATOMIC_RELAXED);
+    do {
+        if (!force && (size_t) (used + 1) * WB_BUFFER_SIZE > wb_limits.budget) return false;
+    } while (!__atomic_compare_exchange_n(used_total, &used, used + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_fetch_add(used_own, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void discharge(unsigned n) {
+    if (used_total == NULL || n == 0) return;
+    __atomic_fetch_sub(used_own, n, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(used_total, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Función: wb_sync_parse
+ * ----------------------
+ * Lee el punto de durabilidad: "written", "fdatasync" o "fsync".
+ */
+bool wb_sync_parse(const char *name) {
+    if (strcmp(name, "written") == 0) wb_limits.sync = WB_WRITTEN;
+    else if (strcmp(name, "fdatasync") == 0) wb_limits.sync = WB_FDATASYNC;
+    else if (strcmp(name, "fsync") == 0) wb_limits.sync = WB_FSYNC;
+    else return false;
+    return true;
+}
+
+/**
+ * Función: wb_sync
+ * ----------------
+ * Lleva el archivo al punto de durabilidad configurado.
+ *
+ * return: false si el disco informó un error
+ */
+bool wb_sync(int fd) {
+    int r = 0;
+
+    if (wb_limits.sync == WB_FDATASYNC) r = fdatasync(fd);
+    else if (wb_limits.sync == WB_FSYNC) r = fsync(fd);
+    if (r < 0) warn("Error syncing file");
+    return r == 0;
+}
+
+static bool write_all(int fd, struct iovec *iov, int n, off_t offset) {
+    ssize_t written;
+
+    while (n > 0) {
+        if ((written = pwritev(fd, iov, n, offset)) < 0) {
+            if (errno == EINTR) continue;
+            warn("Error writing file");
+            return false;
+        }
+        offset += written;
+        for (; n > 0 && (size_t) written >= iov->iov_len; n--, iov++) written -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/**
+ * Función: flush_next
+ * -------------------
+ * Toma los buffers en cola (hasta WB_IOV) y los escribe con un solo
+ * pwritev(). Después avanza head sobre los escritos en orden e informa ese
+ * rango a la política de caché. Se llama con el lock tomado y lo devuelve
+ * tomado.
+ */
+static void flush_next(struct write_behind *wb) {
+    struct iovec iov[WB_IOV];
+    struct wb_buffer *buffer;
+    unsigned first = wb->next, i, n = 0, released = 0;
+    off_t offset = wb->next_offset, start;
+    size_t total = 0;
+    uint64_t begin;
+    bool ok;
+
+    while (wb->next != wb->tail && n < WB_IOV) {
+        buffer = &wb->buffers[wb->next++ % wb->count];
+        iov[n].iov_base = buffer->data;
+        iov[n++].iov_len = buffer->len;
+        total += buffer->len;
+    }
+    wb->next_offset += total;
+    pthread_mutex_unlock(&wb->lock);
+
+    // Después de un error no se escribe más: la transferencia ya falló
+    begin = TRACE_BEGIN();
+    ok = !__atomic_load_n(&wb->failed, __ATOMIC_RELAXED) && write_all(wb->fd, iov, n, offset);
+    TRACE_END("disk_write", begin, total);
+
+    pthread_mutex_lock(&wb->lock);
+    if (!ok) __atomic_store_n(&wb->failed, true, __ATOMIC_RELAXED);
+    for (i = 0; i < n; i++) wb->buffers[(first + i) % wb->count].done = true;
+
+    start = wb->head_offset;
+    while (wb->head != wb->next && (buffer = &wb->buffers[wb->head % wb->count])->done) {
+        wb->head_offset += buffer->len;
+        buffer->done = false;
+        buffer->len = 0;
+        __atomic_store_n(&wb->head, wb->head + 1, __ATOMIC_RELEASE);
+        released++;
+    }
+    wb->charged -= released;
+    discharge(released);
+    pthread_cond_broadcast(&wb->cond);
+
+    // Otro hilo puede avanzar head mientras tanto: el lock de la política se
+    // toma antes de soltar el de la cola para informar los rangos en orden
+    if (wb->head_offset > start && wb->policy != NULL) {
+        pthread_mutex_lock(&wb->policy_lock);
+        pthread_mutex_unlock(&wb->lock);
+        io_policy_written(wb->policy, start, wb->head_offset - start);
+        pthread_mutex_unlock(&wb->policy_lock);
+        pthread_mutex_lock(&wb->lock);
+    }
+}
+
+static void *flusher(void *arg) {
+    struct write_behind *wb = arg;
+
+    pthread_mutex_lock(&wb->lock);
+    while (true) {
+        while (wb->next == wb->tail && !wb->closing) pthread_cond_wait(&wb->cond, &wb->lock);
+        if (wb->next == wb->tail) break;
+        flush_next(wb);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+// Pone en cola el buffer de tail, con el lock tomado; sin hilos se escribe
+// acá mismo
+static void push(struct write_behind *wb) {
+    wb->tail++;
+    wb->tail_charged = false;
+    if (wb->nthreads == 0)
+        while (wb->next != wb->tail) flush_next(wb);
+    pthread_cond_broadcast(&wb->cond);
+}
+
+static void enqueue(struct write_behind *wb) {
+    pthread_mutex_lock(&wb->lock);
+    push(wb);
+    pthread_mutex_unlock(&wb->lock);
+}
+
+/**
+ * Función: wb_start
+ * -----------------
+ * Empieza la escritura diferida de fd desde el offset 0 con el tope de
+ * memoria y los hilos de wb_limits. La memoria se reserva sin tocar: una
+ * subida pequeña sólo ocupa las páginas que llena.
+ *
+ * policy: política de caché a informar de lo escrito, o NULL
+ *
+ * return: el estado de la transferencia, NULL si no se pudo reservar
+ */
+struct write_behind *wb_start(int fd, struct io_policy *policy) {
+    unsigned count = wb_limits.transfer / WB_BUFFER_SIZE, i;
+    struct write_behind *wb;
+    struct arena arena;
+    sigset_t all, prev;
+
+    if (count == 0) count = 1;
+    if (!arena_init(&arena, sizeof(*wb) + count * (sizeof(struct wb_buffer) + WB_BUFFER_SIZE) + 64))
+        return NULL;
+    wb = arena_alloc(&arena, sizeof(*wb) + count * sizeof(struct wb_buffer));
+    memset(wb, 0, sizeof(*wb));
+    wb->fd = fd;
+    wb->policy = policy;
+    wb->count = count;
+    for (i = 0; i < count; i++) {
+        wb->buffers[i].data = arena_alloc(&arena, WB_BUFFER_SIZE);
+        wb->buffers[i].len = 0;
+        wb->buffers[i].done = false;
+    }
+    wb->arena = arena;
+
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_mutex_init(&wb->policy_lock, NULL);
+    pthread_cond_init(&wb->cond, NULL);
+
+    // Los hilos no atienden señales: las maneja el hilo de la sesión
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+    while (wb->nthreads < wb_limits.threads &&
+           pthread_create(&wb->threads[wb->nthreads], NULL, flusher, wb) == 0)
+        wb->nthreads++;
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+    return wb;
+}
+
+// Espera con el lock tomado a que un hilo propio descargue un buffer o a
+// que pase un momento, por si lo descargó otra sesión
+static void budget_wait(struct write_behind *wb) {
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += WB_BUDGET_WAIT * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&wb->cond, &wb->lock, &until);
+}
+
+/**
+ * Función: wb_buffer
+ * ------------------
+ * Devuelve dónde copiar los próximos datos de la red. Si todos los
+ * buffers de la transferencia están en cola o escribiéndose, espera a que
+ * se libere uno. Antes de empezar un buffer lo carga al presupuesto
+ * global; si está agotado espera a que se descargue alguno, de ésta o de
+ * otra sesión. Una transferencia sin buffers cargados toma uno igual, así
+ * ninguna queda esperando a otra detenida.
+ *
+ * room: bytes libres a partir del puntero devuelto
+ *
+ * return: puntero al espacio libre, NULL si una escritura falló
+ */
+char *wb_buffer(struct write_behind *wb, size_t *room) {
+    struct wb_buffer *buffer;
+    uint64_t start;
+    bool charged;
+
+    // head sólo avanza: si ya hay lugar no hace falta el lock
+    if (wb->tail - __atomic_load_n(&wb->head, __ATOMIC_ACQUIRE) >= wb->count) {
+        start = TRACE_BEGIN();
+        pthread_mutex_lock(&wb->lock);
+        while (wb->tail - wb->head >= wb->count && !wb->failed) pthread_cond_wait(&wb->cond, &wb->lock);
+        pthread_mutex_unlock(&wb->lock);
+        TRACE_END("wb_wait", start, 0);
+    }
+    if (__atomic_load_n(&wb->failed, __ATOMIC_RELAXED)) return NULL;
+
+    if (!wb->tail_charged) {
+        pthread_mutex_lock(&wb->lock);
+        if (!(charged = charge(wb->charged == 0))) {
+            start = TRACE_BEGIN();
+            while (!wb->failed && !(charged = charge(wb->charged == 0))) budget_wait(wb);
+            TRACE_END("wb_budget", start, 0);
+        }
+        if (charged) {
+            wb->charged++;
+            wb->tail_charged = true;
+        }
+        pthread_mutex_unlock(&wb->lock);
+        if (!charged) return NULL;
+    }
+
+    buffer = &wb->buffers[wb->tail % wb->count];
+    *room = WB_BUFFER_SIZE - buffer->len;
+    return buffer->data + buffer->len;
+}
+
+/**
+ * Función: wb_commit
+ * ------------------
+ * Confirma len bytes copiados en el espacio de wb_buffer(). Un buffer
+ * lleno pasa a la cola de escritura.
+ *
+ * return: false si una escritura anterior falló
+ */
+bool wb_commit(struct write_behind *wb, size_t len) {
+    struct wb_buffer *buffer = &wb->buffers[wb->tail % wb->count];
+
+    buffer->len += len;
+    if (buffer->len == WB_BUFFER_SIZE) enqueue(wb);
+    return !__atomic_load_n(&wb->failed, __ATOMIC_RELAXED);
+}
+
+/**
+ * Función: wb_finish
+ * ------------------
+ * Escribe lo que quedó, espera a los hilos y, si sync es true, lleva el
+ * archivo al punto de durabilidad de wb_limits. Libera el estado.
+ *
+ * sync: false si la transferencia se abortó; lo recibido se escribe igual
+ *
+ * return: true si todo se escribió (y se sincronizó, si se pidió)
+ */
+bool wb_finish(struct write_behind *wb, bool sync) {
+    struct arena arena = wb->arena;
+    unsigned i;
+    bool ok;
+
+    // Con la cola llena, la casilla de tail es la de head, que un hilo de
+    // escritura puede estar vaciando: se mira con el lock tomado
+    pthread_mutex_lock(&wb->lock);
+    if (wb->tail - wb->head < wb->count && wb->buffers[wb->tail % wb->count].len > 0) push(wb);
+    wb->closing = true;
+    pthread_cond_broadcast(&wb->cond);
+    pthread_mutex_unlock(&wb->lock);
+    for (i = 0; i < wb->nthreads; i++) pthread_join(wb->threads[i], NULL);
+
+    // Sólo puede quedar cargado el buffer de tail, si no se llegó a llenar
+    discharge(wb->charged);
+    ok = !wb->failed;
+    if (ok && sync) ok = wb_sync(wb->fd);
+
+    pthread_cond_destroy(&wb->cond);
+    pthread_mutex_destroy(&wb->policy_lock);
+    pthread_mutex_destroy(&wb->lock);
+    arena_destroy(&arena);
+    return ok;
+}
@@ -0,0 +1,44 @@
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "iopolicy.h"
+
+/**
+ * Escritura diferida de un STOR. La red llena buffers grandes de un
+ * conjunto acotado y sigue recibiendo; hilos de escritura juntan los
+ * buffers llenos consecutivos en una sola escritura secuencial. La red
+ * sólo espera al disco cuando se agotan los buffers de la transferencia o
+ * el presupuesto compartido por todas las sesiones.
+ *
+ * Punto de durabilidad antes de confirmar la transferencia:
+ *
+ *   WB_WRITTEN    los datos están en el kernel (caché de páginas)
+ *   WB_FDATASYNC  los datos y el tamaño están en disco
+ *   WB_FSYNC      también los metadatos
+ */
+enum wb_sync { WB_WRITTEN, WB_FDATASYNC, WB_FSYNC };
+
+struct wb_limits {
+    size_t budget;          // memoria de buffers de todas las sesiones
+    size_t transfer;        // memoria de buffers de una transferencia
+    unsigned threads;       // hilos de escritura; 0 escribe desde la sesión
+    enum wb_sync sync;
+};
+
+struct write_behind;
+
+extern struct wb_limits wb_limits;
+
+bool wb_limits_parse(const char *spec);
+bool wb_sync_parse(const char *name);
+void wb_account(unsigned *total, unsigned *own);
+struct write_behind *wb_start(int fd, struct io_policy *policy);
+char *wb_buffer(struct write_behind *wb, size_t *room);
+bool wb_commit(struct write_behind *wb, size_t len);
+bool wb_finish(struct write_behind *wb, bool sync);
+bool wb_sync(int fd);
+
+#endif